@@ -2,12 +2,53 @@
 #define _AARCH64_PTHREAD_H_
 
 #include <pthread.h>
+#include <stdint.h>
 
-int __aarch64_pthread_create(Dynarmic::A64::Jit *jit, pthread_t *__restrict __newthread, const pthread_attr_t *__restrict __attr, void *(*__start_routine) (void *), void *__restrict __arg);
-int __aarch64_pthread_mutex_destroy(pthread_mutex_t** uid);
-int __aarch64_pthread_mutex_init(pthread_mutex_t** uid, const int* mutexattr);
-int __aarch64_pthread_mutex_lock(pthread_mutex_t** uid);
-int __aarch64_pthread_mutex_unlock(pthread_mutex_t** uid);
-int __aarch64_pthread_once(pthread_once_t *__once_control, void (*__init_routine) (void));
+// pthread_attr_t as laid out by Bionic on AARCH64
+typedef struct {
+	uint32_t flags;
+	void *stack_base;
+	size_t stack_size;
+	size_t guard_size;
+	int32_t sched_policy;
+	int32_t sched_priority;
+	char __reserved[16];
+} aarch64_pthread_attr_t;
+
+#define AARCH64_PTHREAD_ATTR_FLAG_DETACHED (0x1)
+#define AARCH64_PTHREAD_CREATE_JOINABLE (0)
+#define AARCH64_PTHREAD_CREATE_DETACHED (1)
+#define AARCH64_PTHREAD_STACK_MIN (0x4000)
+
+// pthread_mutexattr_t types as defined by Bionic
+#define AARCH64_PTHREAD_MUTEX_NORMAL (0)
+#define AARCH64_PTHREAD_MUTEX_RECURSIVE (1)
+#define AARCH64_PTHREAD_MUTEX_ERRORCHECK (2)
+
+struct aarch64_mutex; // Lives in place in the guest pthread_mutex_t, see pthread.cpp
+
+void aarch64_thread_pool_init(int count);
+void aarch64_thread_pool_print_stats(void);
+
+int __aarch64_pthread_attr_init(aarch64_pthread_attr_t *__attr);
+int __aarch64_pthread_attr_setdetachstate(aarch64_pthread_attr_t *__attr, int __state);
+int __aarch64_pthread_attr_setstacksize(aarch64_pthread_attr_t *__attr, size_t __size);
+int __aarch64_pthread_create(uintptr_t *__newthread, const aarch64_pthread_attr_t *__attr, void *(*__start_routine) (void *), void *__arg);
+int __aarch64_pthread_detach(uintptr_t __th);
+int __aarch64_pthread_key_create(int *__key, void (*__destructor)(void *));
+int __aarch64_pthread_key_delete(int __key);
+void *__aarch64_pthread_getspecific(int __key);
+int __aarch64_pthread_setspecific(int __key, const void *__value);
+int __aarch64_pthread_join(uintptr_t __th, void **__retval);
+uintptr_t __aarch64_pthread_self(void);
+int __aarch64_pthread_mutexattr_init(int64_t *__attr);
+int __aarch64_pthread_mutexattr_settype(int64_t *__attr, int __type);
+int __aarch64_pthread_mutexattr_gettype(const int64_t *__attr, int *__type);
+int __aarch64_pthread_mutex_destroy(aarch64_mutex *__mutex);
+int __aarch64_pthread_mutex_init(aarch64_mutex *__mutex, const int64_t *__attr);
+int __aarch64_pthread_mutex_lock(aarch64_mutex *__mutex);
+int __aarch64_pthread_mutex_trylock(aarch64_mutex *__mutex);
+int __aarch64_pthread_mutex_unlock(aarch64_mutex *__mutex);
+int __aarch64_pthread_once(uint32_t *__once_control, void (*__init_routine) (void));
 
 #endif
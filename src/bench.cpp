@@ -0,0 +1,562 @@
+// Lightweight benchmarking helpers used to compare dynarec configurations at runtime
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "dynarec.h"
+#include "so_util.h"
+#include "thunk_gen.h"
+#include "bench.h"
+#include "aarch64_pthread.h"
+
+int bench_frames_interval = 0;
+const char *bench_name = nullptr;
+
+static uint64_t frame_last = 0;
+static uint64_t frame_total = 0;
+static uint64_t frame_min = UINT64_MAX;
+static uint64_t frame_max = 0;
+static int frame_count = 0;
+
+uint64_t bench_now_ns(void) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Called once per presented frame, reports average/min/max frame time every bench_frames_interval frames
+void bench_frame_tick(void) {
+	if (!bench_frames_interval)
+		return;
+
+	uint64_t now = bench_now_ns();
+	if (frame_last) {
+		uint64_t delta = now - frame_last;
+		frame_total += delta;
+		if (delta < frame_min)
+			frame_min = delta;
+		if (delta > frame_max)
+			frame_max = delta;
+		if (++frame_count == bench_frames_interval) {
+			printf("[bench] %s: %d frames, avg %.3f ms, min %.3f ms, max %.3f ms\n",
+				so_mem_mode_name(), frame_count,
+				frame_total / 1e6 / frame_count, frame_min / 1e6, frame_max / 1e6);
+			frame_total = 0;
+			frame_min = UINT64_MAX;
+			frame_max = 0;
+			frame_count = 0;
+		}
+	}
+	frame_last = now;
+}
+
+/*
+ * TLB miss counters of the calling thread, read through perf_event_open on Linux. Comparing
+ * runs with and without --huge-pages shows what huge pages save.
+ */
+#define BENCH_PERF_COUNTERS (2)
+
+typedef struct {
+	int fd[BENCH_PERF_COUNTERS];
+} bench_perf;
+
+static void bench_perf_start(bench_perf *perf) {
+#ifdef __linux__
+	static const uint64_t configs[BENCH_PERF_COUNTERS] = {
+		PERF_COUNT_HW_CACHE_ITLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+	};
+	for (int i = 0; i < BENCH_PERF_COUNTERS; i++) {
+		struct perf_event_attr attr = {};
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.size = sizeof(attr);
+		attr.config = configs[i];
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		perf->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (perf->fd[i] >= 0) {
+			ioctl(perf->fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(perf->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+#else
+	for (int i = 0; i < BENCH_PERF_COUNTERS; i++)
+		perf->fd[i] = -1;
+#endif
+}
+
+static void bench_perf_stop(bench_perf *perf, const char *name, uint64_t ops) {
+	static const char *labels[BENCH_PERF_COUNTERS] = {"iTLB", "dTLB"};
+	printf("[bench] %s (%s):", name, guest_mem_huge_pages ? "huge pages" : "regular pages");
+	for (int i = 0; i < BENCH_PERF_COUNTERS; i++) {
+		uint64_t misses = 0;
+#ifdef __linux__
+		if (perf->fd[i] >= 0) {
+			ioctl(perf->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+			if (read(perf->fd[i], &misses, sizeof(misses)) != sizeof(misses))
+				misses = 0;
+			close(perf->fd[i]);
+			printf(" %s load misses %llu (%.4f/op)", labels[i], misses, (double)misses / ops);
+			continue;
+		}
+#endif
+		printf(" %s load misses n/a", labels[i]);
+	}
+	printf("\n");
+}
+
+/*
+ * Minimal AARCH64 encoders used to assemble the guest side of microbenchmarks
+ */
+enum {
+	A64_COND_EQ = 0,
+	A64_COND_NE = 1,
+};
+
+static inline uint32_t a64_mov(int rd, int rm) { return 0xAA0003E0 | (rm << 16) | rd; } // ORR Xd, XZR, Xm
+static inline uint32_t a64_add_imm(int rd, int rn, int imm) { return 0x91000000 | (imm << 10) | (rn << 5) | rd; }
+static inline uint32_t a64_subs_imm(int rd, int rn, int imm) { return 0xF1000000 | (imm << 10) | (rn << 5) | rd; }
+static inline uint32_t a64_ldr(int rt, int rn) { return 0xF9400000 | (rn << 5) | rt; }
+static inline uint32_t a64_str_post(int rt, int rn, int imm) { return 0xF8000400 | ((imm & 0x1FF) << 12) | (rn << 5) | rt; }
+static inline uint32_t a64_b_cond(int cond, int insn_offs) { return 0x54000000 | ((insn_offs & 0x7FFFF) << 5) | cond; }
+static inline uint32_t a64_ldaxr(int rt, int rn) { return 0xC85FFC00 | (rn << 5) | rt; }
+static inline uint32_t a64_stlxr(int rs, int rt, int rn) { return 0xC800FC00 | (rs << 16) | (rn << 5) | rt; }
+static inline uint32_t a64_cbnz_w(int rt, int insn_offs) { return 0x35000000 | ((insn_offs & 0x7FFFF) << 5) | rt; }
+static inline uint32_t a64_blr(int rn) { return 0xD63F0000 | (rn << 5); }
+static inline uint32_t a64_ret() { return 0xD65F03C0; }
+static inline uint32_t a64_madd(int rd, int rn, int rm, int ra) { return 0x9B000000 | (rm << 16) | (ra << 10) | (rn << 5) | rd; }
+static inline uint32_t a64_lsr_imm(int rd, int rn, int shift) { return 0xD340FC00 | (shift << 16) | (rn << 5) | rd; } // UBFM Xd, Xn, #shift, #63
+static inline uint32_t a64_and(int rd, int rn, int rm) { return 0x8A000000 | (rm << 16) | (rn << 5) | rd; }
+static inline uint32_t a64_add(int rd, int rn, int rm) { return 0x8B000000 | (rm << 16) | (rn << 5) | rd; }
+static inline uint32_t a64_movz(int rd, int imm) { return 0xD2800000 | (imm << 5) | rd; }
+static inline uint32_t a64_str_w(int rt, int rn) { return 0xB9000000 | (rn << 5) | rt; }
+static inline uint32_t a64_ldr_reg(int rt, int rn, int rm) { return 0xF8606800 | (rm << 16) | (rn << 5) | rt; }
+
+// Guest loads, increments and stores every qword of a buffer (X0 = buffer, X1 = size, X2 = passes)
+static int bench_memory(void) {
+	const size_t buf_size = 1024 * 1024;
+	const uint64_t passes = 64;
+
+	uint32_t *code = (uint32_t *)guest_malloc(16 * sizeof(uint32_t));
+	uint8_t *buf = (uint8_t *)guest_calloc(1, buf_size);
+	if (!code || !buf) {
+		printf("[bench] memory: failed to allocate guest buffers\n");
+		return -1;
+	}
+
+	int n = 0;
+	code[n++] = a64_mov(3, 0);           // outer: mov x3, x0
+	code[n++] = a64_mov(4, 1);           //        mov x4, x1
+	code[n++] = a64_ldr(5, 3);           // inner: ldr x5, [x3]
+	code[n++] = a64_add_imm(5, 5, 1);    //        add x5, x5, #1
+	code[n++] = a64_str_post(5, 3, 8);   //        str x5, [x3], #8
+	code[n++] = a64_subs_imm(4, 4, 8);   //        subs x4, x4, #8
+	code[n++] = a64_b_cond(A64_COND_NE, -4); //    b.ne inner
+	code[n++] = a64_subs_imm(2, 2, 1);   //        subs x2, x2, #1
+	code[n++] = a64_b_cond(A64_COND_NE, -8); //    b.ne outer
+	code[n++] = a64_ret();
+
+	// Warm up the code cache first so that only the steady state is measured
+	for (int i = 0; i < 2; i++) {
+		bench_perf perf;
+		so_dynarec->SetRegister(0, (uintptr_t)buf);
+		so_dynarec->SetRegister(1, buf_size);
+		so_dynarec->SetRegister(2, i ? passes : 1);
+		if (i)
+			bench_perf_start(&perf);
+		uint64_t start = bench_now_ns();
+		so_run_fiber(so_dynarec, (uintptr_t)code);
+		uint64_t elapsed = bench_now_ns() - start;
+		if (i) {
+			uint64_t accesses = passes * (buf_size / 8) * 2;
+			printf("[bench] memory (%s): %llu accesses in %.3f ms, %.3f ns/access\n", so_mem_mode_name(),
+				accesses, elapsed / 1e6, (double)elapsed / accesses);
+			bench_perf_stop(&perf, "memory", accesses);
+		}
+	}
+
+	if (*(uint64_t *)buf != passes + 1) {
+		printf("[bench] memory: unexpected result %llu\n", *(uint64_t *)buf);
+		return -1;
+	}
+	if (so_mem_mode == DYNAREC_MEM_PAGETABLE)
+		guest_mem_print_stats();
+
+	guest_free(buf);
+	guest_free(code);
+	return 0;
+}
+
+// Several Jit instances hammer a single counter with LDAXR/STLXR increments (X0 = counter, X1 = iterations)
+static int bench_atomics(void) {
+	const uint64_t iterations = 200000;
+
+	uint32_t *code = (uint32_t *)guest_malloc(8 * sizeof(uint32_t));
+	uint64_t *counter = (uint64_t *)guest_calloc(1, 64);
+	if (!code || !counter) {
+		printf("[bench] atomics: failed to allocate guest buffers\n");
+		return -1;
+	}
+
+	int n = 0;
+	code[n++] = a64_ldaxr(2, 0);         // loop: ldaxr x2, [x0]
+	code[n++] = a64_add_imm(2, 2, 1);    //       add x2, x2, #1
+	code[n++] = a64_stlxr(3, 2, 0);      //       stlxr w3, x2, [x0]
+	code[n++] = a64_cbnz_w(3, -3);       //       cbnz w3, loop
+	code[n++] = a64_subs_imm(1, 1, 1);   //       subs x1, x1, #1
+	code[n++] = a64_b_cond(A64_COND_NE, -5); //   b.ne loop
+	code[n++] = a64_ret();
+
+	unsigned max_threads = std::thread::hardware_concurrency();
+	if (max_threads > DYNAREC_MAX_PROCESSORS)
+		max_threads = DYNAREC_MAX_PROCESSORS;
+
+	int res = 0;
+	for (unsigned num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+		*counter = 0;
+		std::vector<std::thread> threads;
+		uint64_t start = bench_now_ns();
+		for (unsigned i = 0; i < num_threads; i++) {
+			threads.emplace_back([=]() {
+				Dynarmic::A64::UserConfig cfg = so_dynarec_cfg;
+				cfg.processor_id = i;
+				so_dynarec = new Dynarmic::A64::Jit(cfg);
+				uint8_t *stack = (uint8_t *)guest_mem_alloc(0x10000);
+				so_dynarec->SetSP((uintptr_t)stack + 0x10000 - 8);
+				so_dynarec->SetRegister(0, (uintptr_t)counter);
+				so_dynarec->SetRegister(1, iterations);
+				so_run_fiber(so_dynarec, (uintptr_t)code);
+				delete so_dynarec;
+				guest_mem_free(stack, 0x10000);
+			});
+		}
+		for (auto &t : threads)
+			t.join();
+		uint64_t elapsed = bench_now_ns() - start;
+
+		uint64_t expected = iterations * num_threads;
+		printf("[bench] atomics: %u processors, %llu increments in %.3f ms, %.3f ns/increment%s\n", num_threads,
+			expected, elapsed / 1e6, (double)elapsed / expected, *counter == expected ? "" : " (LOST UPDATES)");
+		if (*counter != expected)
+			res = -1;
+	}
+
+	guest_free(counter);
+	guest_free(code);
+	return res;
+}
+
+// Guest calls a trivial host import (rand) in a tight loop (X0 = trampoline, X1 = calls), once
+// through the inline SVC path and once through the halting path used by nested thunks
+static int bench_hostcall(void) {
+	const uint64_t calls = 1000000;
+
+	uint32_t *code = (uint32_t *)guest_malloc(16 * sizeof(uint32_t));
+	uint32_t *trampolines = (uint32_t *)guest_malloc(4 * sizeof(uint32_t));
+	if (!code || !trampolines) {
+		printf("[bench] hostcall: failed to allocate guest buffers\n");
+		return -1;
+	}
+
+	int n = 0;
+	code[n++] = 0xA9BF7BFD;              //       stp x29, x30, [sp, #-16]!
+	code[n++] = a64_mov(19, 1);          //       mov x19, x1
+	code[n++] = a64_mov(20, 0);          //       mov x20, x0
+	code[n++] = a64_blr(20);             // loop: blr x20
+	code[n++] = a64_subs_imm(19, 19, 1); //       subs x19, x19, #1
+	code[n++] = a64_b_cond(A64_COND_NE, -2); //   b.ne loop
+	code[n++] = 0xA8C17BFD;              //       ldp x29, x30, [sp], #16
+	code[n++] = a64_ret();
+
+	const dynarec_thunk *target = so_find_import("rand");
+	if (!target) {
+		printf("[bench] hostcall: rand import not found\n");
+		return -1;
+	}
+	uint32_t id = target - dynarec_imports;
+	std::array<uint32_t, 2> fast = gen_trampoline(id, false);
+	std::array<uint32_t, 2> nested = gen_trampoline(id, true);
+	memcpy(&trampolines[0], fast.data(), sizeof(fast));
+	memcpy(&trampolines[2], nested.data(), sizeof(nested));
+
+	const char *names[] = {"inline", "nested"};
+	for (int t = 0; t < 2; t++) {
+		// Warm up the code cache first so that only the steady state is measured
+		for (int i = 0; i < 2; i++) {
+			so_dynarec->SetRegister(0, (uintptr_t)&trampolines[t * 2]);
+			so_dynarec->SetRegister(1, i ? calls : 1);
+			uint64_t start = bench_now_ns();
+			so_run_fiber(so_dynarec, (uintptr_t)code);
+			uint64_t elapsed = bench_now_ns() - start;
+			if (i) {
+				printf("[bench] hostcall (%s): %llu calls in %.3f ms, %.3f ns/call\n", names[t],
+					calls, elapsed / 1e6, (double)elapsed / calls);
+			}
+		}
+	}
+
+	guest_free(trampolines);
+	guest_free(code);
+	return 0;
+}
+
+// Guest performs pseudo random qword loads across a buffer far larger than the TLB reach
+// (X0 = buffer, X1 = offset mask, X2 = loads), so that the page size backing it dominates
+static int bench_tlb(void) {
+	const size_t buf_size = 64 * 1024 * 1024;
+	const uint64_t loads = 4000000;
+
+	uint32_t *code = (uint32_t *)guest_malloc(16 * sizeof(uint32_t));
+	uint8_t *buf = (uint8_t *)guest_mem_alloc(buf_size);
+	if (!code || !buf) {
+		printf("[bench] tlb: failed to allocate guest buffers\n");
+		return -1;
+	}
+	for (size_t i = 0; i < buf_size; i += 8)
+		*(uint64_t *)(buf + i) = 1;
+
+	int n = 0;
+	code[n++] = a64_madd(3, 3, 6, 7);    // loop: madd x3, x3, x6, x7
+	code[n++] = a64_lsr_imm(4, 3, 16);   //       lsr x4, x3, #16
+	code[n++] = a64_and(4, 4, 1);        //       and x4, x4, x1
+	code[n++] = a64_ldr_reg(5, 0, 4);    //       ldr x5, [x0, x4]
+	code[n++] = a64_add(8, 8, 5);        //       add x8, x8, x5
+	code[n++] = a64_subs_imm(2, 2, 1);   //       subs x2, x2, #1
+	code[n++] = a64_b_cond(A64_COND_NE, -6); //   b.ne loop
+	code[n++] = a64_ret();
+
+	// Warm up the code cache first so that only the steady state is measured
+	for (int i = 0; i < 2; i++) {
+		bench_perf perf;
+		so_dynarec->SetRegister(0, (uintptr_t)buf);
+		so_dynarec->SetRegister(1, (buf_size - 1) & ~7ULL);
+		so_dynarec->SetRegister(2, i ? loads : 1);
+		so_dynarec->SetRegister(3, 0x2545F4914F6CDD1DULL);
+		so_dynarec->SetRegister(6, 6364136223846793005ULL);
+		so_dynarec->SetRegister(7, 1442695040888963407ULL);
+		so_dynarec->SetRegister(8, 0);
+		if (i)
+			bench_perf_start(&perf);
+		uint64_t start = bench_now_ns();
+		so_run_fiber(so_dynarec, (uintptr_t)code);
+		uint64_t elapsed = bench_now_ns() - start;
+		if (i) {
+			printf("[bench] tlb (%s): %llu loads over %zu MB in %.3f ms, %.3f ns/load\n", so_mem_mode_name(),
+				loads, buf_size >> 20, elapsed / 1e6, (double)elapsed / loads);
+			bench_perf_stop(&perf, "tlb", loads);
+		}
+	}
+
+	if (so_dynarec->GetRegister(8) != loads) {
+		printf("[bench] tlb: unexpected result %llu\n", so_dynarec->GetRegister(8));
+		return -1;
+	}
+
+	guest_mem_free(buf, buf_size);
+	guest_free(code);
+	return 0;
+}
+
+// Guest code rewriting a write protected function (mov x0, #N; ret) twice in a row. Each write has to
+// trap and invalidate the page again, or the second call keeps running the stale translation.
+static int bench_smc(void) {
+	const size_t page_size = 0x10000; // A multiple of any host page size
+
+	uint32_t *func = (uint32_t *)guest_mem_alloc(page_size);
+	uint32_t *writer = (uint32_t *)guest_malloc(2 * sizeof(uint32_t));
+	if (!func || !writer) {
+		printf("[bench] smc: failed to allocate guest buffers\n");
+		return -1;
+	}
+	func[0] = a64_movz(0, 1);
+	func[1] = a64_ret();
+	writer[0] = a64_str_w(1, 0); // str w1, [x0]
+	writer[1] = a64_ret();
+	so_protect_text();
+	if (!so_protect_text_range((uintptr_t)func, page_size)) {
+		printf("[bench] smc: failed to write protect guest code\n");
+		return -1;
+	}
+
+	uint64_t invalidations = so_text_invalidations;
+	for (int i = 1; i <= 3; i++) {
+		if (i > 1) {
+			so_dynarec->SetRegister(0, (uintptr_t)func);
+			so_dynarec->SetRegister(1, a64_movz(0, i));
+			uint64_t start = bench_now_ns();
+			so_run_fiber(so_dynarec, (uintptr_t)writer);
+			printf("[bench] smc: trapped write and invalidation in %.3f us\n", (bench_now_ns() - start) / 1e3);
+		}
+		so_run_fiber(so_dynarec, (uintptr_t)func);
+		if (so_dynarec->GetRegister(0) != i) {
+			printf("[bench] smc: stale code ran after write %d (got %llu)\n", i - 1, so_dynarec->GetRegister(0));
+			return -1;
+		}
+	}
+	invalidations = so_text_invalidations - invalidations;
+	printf("[bench] smc: %llu invalidations for 2 writes to the same page%s\n", invalidations, invalidations == 2 ? "" : " (MISMATCH)");
+
+	// func stays allocated, it is registered as text from now on
+	guest_free(writer);
+	return invalidations == 2 ? 0 : -1;
+}
+
+// Host side malloc/free pairs over the guest heap, spread over the slab size classes and the
+// large object path. No guest code involved, so it runs with either backend.
+static int bench_heap(void) {
+	const int rounds = 2000;
+	const int live = 256;
+	static const size_t sizes[] = {16, 24, 64, 100, 256, 700, 2048, 4096};
+	const int num_sizes = sizeof(sizes) / sizeof(*sizes);
+	std::vector<void *> ptrs(live);
+
+	for (int s = 0; s < num_sizes; s++) {
+		// Warm up the thread cache first so that only the steady state is measured
+		for (int i = 0; i < live; i++)
+			guest_free(guest_malloc(sizes[s]));
+		uint64_t start = bench_now_ns();
+		for (int r = 0; r < rounds; r++) {
+			for (int i = 0; i < live; i++)
+				ptrs[i] = guest_malloc(sizes[s]);
+			for (int i = 0; i < live; i++)
+				guest_free(ptrs[i]);
+		}
+		uint64_t elapsed = bench_now_ns() - start;
+		uint64_t pairs = (uint64_t)rounds * live;
+		printf("[bench] heap (%zu bytes): %llu malloc/free pairs in %.3f ms, %.3f ns/pair\n", sizes[s],
+			pairs, elapsed / 1e6, (double)elapsed / pairs);
+	}
+
+	guest_heap_print_stats();
+	return 0;
+}
+
+// Guest threads running an empty body (mov x0, #0; ret), created and joined one after the other.
+// Only the first one has to build a Jit when the pool starts out empty.
+static int bench_threads(void) {
+	const int count = 200;
+
+	uint32_t *code = (uint32_t *)guest_malloc(2 * sizeof(uint32_t));
+	if (!code) {
+		printf("[bench] threads: failed to allocate guest buffers\n");
+		return -1;
+	}
+	code[0] = 0xD2800000; // mov x0, #0
+	code[1] = a64_ret();
+
+	uint64_t first = 0, total = 0;
+	for (int i = 0; i < count; i++) {
+		uintptr_t thread;
+		uint64_t start = bench_now_ns();
+		if (__aarch64_pthread_create(&thread, NULL, (void *(*)(void *))code, NULL) || __aarch64_pthread_join(thread, NULL)) {
+			printf("[bench] threads: failed to run guest thread\n");
+			return -1;
+		}
+		uint64_t elapsed = bench_now_ns() - start;
+		if (i)
+			total += elapsed;
+		else
+			first = elapsed;
+	}
+	printf("[bench] threads: first create/join %.3f us, then %.3f us on average\n", first / 1e3, (double)total / (count - 1) / 1e3);
+	aarch64_thread_pool_print_stats();
+
+	guest_free(code);
+	return 0;
+}
+
+// Lock/unlock of one guest pthread_mutex_t hammered by an increasing number of host threads, against
+// what the guest got before: a host pthread_mutex_t calloc'd on first use and reached through the guest word.
+static int bench_legacy_mutex_lock(pthread_mutex_t **uid) {
+	static std::mutex init_mutex;
+	if (!*uid) {
+		std::lock_guard<std::mutex> lock(init_mutex);
+		if (!*uid) {
+			pthread_mutex_t *m = (pthread_mutex_t *)calloc(1, sizeof(pthread_mutex_t));
+			pthread_mutex_init(m, NULL);
+			*uid = m;
+		}
+	}
+	return pthread_mutex_lock(*uid);
+}
+
+static int bench_mutex(void) {
+	const uint64_t iterations = 200000;
+	unsigned max_threads = std::thread::hardware_concurrency();
+	if (max_threads > DYNAREC_MAX_PROCESSORS)
+		max_threads = DYNAREC_MAX_PROCESSORS;
+
+	for (unsigned num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+		for (int legacy = 0; legacy < 2; legacy++) {
+			alignas(8) uint32_t guest_mutex[10] = {}; // Bionic pthread_mutex_t, PTHREAD_MUTEX_INITIALIZER
+			pthread_mutex_t *host_mutex = nullptr;
+			uint64_t counter = 0;
+			std::vector<std::thread> threads;
+			uint64_t start = bench_now_ns();
+			for (unsigned i = 0; i < num_threads; i++) {
+				threads.emplace_back([&]() {
+					for (uint64_t j = 0; j < iterations; j++) {
+						if (legacy) {
+							bench_legacy_mutex_lock(&host_mutex);
+							counter++;
+							pthread_mutex_unlock(host_mutex);
+						} else {
+							__aarch64_pthread_mutex_lock((aarch64_mutex *)guest_mutex);
+							counter++;
+							__aarch64_pthread_mutex_unlock((aarch64_mutex *)guest_mutex);
+						}
+					}
+				});
+			}
+			for (auto &t : threads)
+				t.join();
+			uint64_t elapsed = bench_now_ns() - start;
+
+			uint64_t expected = iterations * num_threads;
+			printf("[bench] mutex (%s): %u threads, %llu lock/unlock pairs in %.3f ms, %.3f ns/pair%s\n", legacy ? "host" : "guest",
+				num_threads, expected, elapsed / 1e6, (double)elapsed / expected, counter == expected ? "" : " (MISMATCH)");
+			if (host_mutex) {
+				pthread_mutex_destroy(host_mutex);
+				free(host_mutex);
+			}
+		}
+	}
+	return 0;
+}
+
+int bench_run(const char *name) {
+	if (!strcmp(name, "heap"))
+		return bench_heap();
+	if (!strcmp(name, "mutex"))
+		return bench_mutex();
+#ifdef USE_INTERPRETER
+	printf("[bench] microbenchmarks are only available with the Dynarmic backend\n");
+	return -1;
+#else
+	if (!strcmp(name, "memory"))
+		return bench_memory();
+	if (!strcmp(name, "atomics"))
+		return bench_atomics();
+	if (!strcmp(name, "hostcall"))
+		return bench_hostcall();
+	if (!strcmp(name, "tlb"))
+		return bench_tlb();
+	if (!strcmp(name, "threads"))
+		return bench_threads();
+	if (!strcmp(name, "smc"))
+		return bench_smc();
+
+	printf("[bench] unknown benchmark: %s\n", name);
+	return -1;
+#endif
+}
@@ -0,0 +1,15 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdint.h>
+
+// Number of presented frames between two frame-time reports (0 disables reporting)
+extern int bench_frames_interval;
+// Name of the microbenchmark requested on command line, if any
+extern const char *bench_name;
+
+uint64_t bench_now_ns(void);
+void bench_frame_tick(void);
+int bench_run(const char *name);
+
+#endif
@@ -10,9 +10,37 @@
 #include "dynarmic/interface/A64/config.h"
 #include "dynarmic/interface/exclusive_monitor.h"
 
+#include "guest_mem.h"
+
 #define DYNAREC_MEMBLK_SIZE (32 * 1024 * 1024)
 #define DYNAREC_STACK_SIZE (8 * 1024 * 1024)
-#define DYNAREC_TPIDR_SIZE (4096)
+#define DYNAREC_TPIDR_SIZE (4096) // Minimum size of a guest thread TLS block
+
+// Bionic TLS layout: TPIDR_EL0 points at slot 0 with slot -1 right below it, the static
+// TLS of every module follows the slots at an offset fixed at load time
+#define DYNAREC_TLS_SLOT_MIN (-1)
+#define DYNAREC_TLS_SLOT_MAX (8)
+#define DYNAREC_TLS_SLOT_STACK_GUARD (5)
+#define DYNAREC_TLS_KEYS (128) // pthread key values, stored right below slot DYNAREC_TLS_SLOT_MIN
+#define DYNAREC_MAX_PROCESSORS (16) // Max number of Jit instances sharing so_monitor
+#define DYNAREC_JIT_POOL_MAX (8) // Idle Jit instances kept for new guest threads
+#define DYNAREC_JIT_POOL_PREBUILT (2) // Jit instances built at startup
+#define DYNAREC_CODE_CACHE_SIZE (128 * 1024 * 1024)
+#define DYNAREC_CODE_CACHE_MAX_MB (4094) // Dynarmic keeps the size in 32 bits, a multiple of 2 MB has to fit too
+
+// SVC immediates understood by so_env::CallSVC
+#define DYNAREC_SVC_EXIT (0) // Return from top-level function
+#define DYNAREC_SVC_UNRESOLVED (2) // Unresolved import called
+#define DYNAREC_SVC_LAZY_BIND (3) // PLT slot called for the first time with lazy binding
+#define DYNAREC_SVC_THUNK (0x8000) // Host thunk, low bits hold its id
+#define DYNAREC_SVC_THUNK_NESTED (0x4000) // Host thunk that runs guest code itself, executed outside of Jit::Run
+#define DYNAREC_SVC_THUNK_MASK (0x3FFF)
+
+// Thunk ids, index in dynarec_imports or in dynarec_hooks if DYNAREC_THUNK_HOOK is set
+#define DYNAREC_THUNK_HOOK (0x1000)
+#define DYNAREC_THUNK_INDEX_MASK (0x0FFF)
+#define DYNAREC_SVC(imm) (0xD4000001 | ((imm) << 5))
+#define DYNAREC_RET (0xD65F03C0)
 
 #ifdef NDEBUG
 #define debugLog
@@ -27,16 +55,25 @@
 #define REG_FP (30) // Frame Pointer register
 #endif
 
-#define TPIDR_EL0_HACK // Looks like Dynarmic has some issue handling MRS/MSR properly with TPIDR register, this workarounds the issue
+// Guest memory access modes supported by the Dynarmic backend
+enum {
+	DYNAREC_MEM_CALLBACKS, // Every load/store goes through so_env Memory* callbacks
+	DYNAREC_MEM_FASTMEM,   // JIT emits direct host accesses, callbacks are used only on faults
+	DYNAREC_MEM_PAGETABLE, // JIT translates through guest_page_table, guest memory is isolated from host one
+};
 
-extern Dynarmic::A64::Jit *so_dynarec;
+extern int so_mem_mode;
+extern size_t so_code_cache_size;
+const char *so_mem_mode_name(void);
+extern thread_local Dynarmic::A64::Jit *so_dynarec; // Jit instance running on the calling host thread
 extern Dynarmic::A64::UserConfig so_dynarec_cfg;
 extern Dynarmic::ExclusiveMonitor *so_monitor;
 extern uint8_t *so_stack;
 extern uint8_t *tpidr_el0;
+extern uint64_t tpidr_el0_reg;
 extern void *dynarec_base_addr;
 
-class so_env final : public Dynarmic::A64::UserCallbacks {
+class so_env : public Dynarmic::A64::UserCallbacks {
 public:
 	std::uint64_t ticks_left = 0;
 	std::uint64_t mem_size = 0;
@@ -50,48 +87,28 @@ public:
 	}
 	
 	std::uint8_t MemoryRead8(std::uint64_t vaddr) override {
-#ifdef TPIDR_EL0_HACK
-		if ((uintptr_t)vaddr < 0x1000)
-			vaddr += (uintptr_t)tpidr_el0;
-#endif
 		return *(std::uint8_t *)vaddr;
 	}
 
 	std::uint16_t MemoryRead16(std::uint64_t vaddr) override {
-#ifdef TPIDR_EL0_HACK
-		if ((uintptr_t)vaddr < 0x1000)
-			vaddr += (uintptr_t)tpidr_el0;
-#endif
 		std::uint16_t ret;
 		memcpy(&ret, (std::uint16_t *)vaddr, 2);
 		return ret;
 	}
 
 	std::uint32_t MemoryRead32(std::uint64_t vaddr) override {
-#ifdef TPIDR_EL0_HACK
-		if ((uintptr_t)vaddr < 0x1000)
-			vaddr += (uintptr_t)tpidr_el0;
-#endif
 		std::uint32_t ret;
 		memcpy(&ret, (std::uint32_t *)vaddr, 4);
 		return ret;
 	}
 
 	std::uint64_t MemoryRead64(std::uint64_t vaddr) override {
-#ifdef TPIDR_EL0_HACK
-		if ((uintptr_t)vaddr < 0x1000)
-			vaddr += (uintptr_t)tpidr_el0;
-#endif
 		std::uint64_t ret;
 		memcpy(&ret, (std::uint64_t *)vaddr, 8);
 		return ret;
 	}
 	
 	Dynarmic::A64::Vector MemoryRead128(std::uint64_t vaddr) override {
-#ifdef TPIDR_EL0_HACK
-		if ((uintptr_t)vaddr < 0x1000)
-			vaddr += (uintptr_t)tpidr_el0;
-#endif
 		Dynarmic::A64::Vector data;
 		memcpy(&data[0], (std::uint64_t *)vaddr, 8);
 		memcpy(&data[1], (std::uint64_t *)(vaddr + 8), 8);
@@ -119,26 +136,25 @@ public:
 		memcpy((void *)(vaddr + 8), &value[1], 8);
 	}
 	
-	bool MemoryWriteExclusive8(std::uint64_t vaddr, std::uint8_t value, [[maybe_unused]] std::uint8_t expected) override {
-		*(std::uint8_t *)vaddr = value;
-		return true;
+	// Exclusive stores only succeed if memory still holds the value observed by the paired
+	// exclusive load, this keeps LDXR/STXR sequences atomic against other guest threads
+	bool MemoryWriteExclusive8(std::uint64_t vaddr, std::uint8_t value, std::uint8_t expected) override {
+		return __atomic_compare_exchange_n((std::uint8_t *)vaddr, &expected, value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
 	}
-	bool MemoryWriteExclusive16(std::uint64_t vaddr, std::uint16_t value, [[maybe_unused]] std::uint16_t expected) override {
-		*(std::uint16_t *)(vaddr) = value;
-		return true;
+	bool MemoryWriteExclusive16(std::uint64_t vaddr, std::uint16_t value, std::uint16_t expected) override {
+		return __atomic_compare_exchange_n((std::uint16_t *)vaddr, &expected, value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
 	}
-	bool MemoryWriteExclusive32(std::uint64_t vaddr, std::uint32_t value, [[maybe_unused]] std::uint32_t expected) override {
-		*(std::uint32_t *)(vaddr) = value;
-		return true;
+	bool MemoryWriteExclusive32(std::uint64_t vaddr, std::uint32_t value, std::uint32_t expected) override {
+		return __atomic_compare_exchange_n((std::uint32_t *)vaddr, &expected, value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
 	}
-	bool MemoryWriteExclusive64(std::uint64_t vaddr, std::uint64_t value, [[maybe_unused]] std::uint64_t expected) override {
-		*(std::uint64_t *)(vaddr) = value;
-		return true;
+	bool MemoryWriteExclusive64(std::uint64_t vaddr, std::uint64_t value, std::uint64_t expected) override {
+		return __atomic_compare_exchange_n((std::uint64_t *)vaddr, &expected, value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
 	}
-	bool MemoryWriteExclusive128(std::uint64_t vaddr, Dynarmic::A64::Vector value, [[maybe_unused]] Dynarmic::A64::Vector expected) override {
-		*(std::uint64_t *)(vaddr) = value[0];
-		*(std::uint64_t *)(vaddr + 8) = value[1];
-		return true;
+	bool MemoryWriteExclusive128(std::uint64_t vaddr, Dynarmic::A64::Vector value, Dynarmic::A64::Vector expected) override {
+		// Requires -mcx16 so that this is emitted inline as cmpxchg16b
+		unsigned __int128 v = ((unsigned __int128)value[1] << 64) | value[0];
+		unsigned __int128 e = ((unsigned __int128)expected[1] << 64) | expected[0];
+		return __sync_bool_compare_and_swap((unsigned __int128 *)vaddr, e, v);
 	}
 
 	void InterpreterFallback(std::uint64_t pc, size_t num_instructions) override {
@@ -168,6 +184,61 @@ public:
 	}
 };
 
+// Callbacks used in page table mode, only reached by accesses the page table can't translate
+class so_pt_env final : public so_env {
+public:
+	std::uint8_t MemoryRead8(std::uint64_t vaddr) override {
+		guest_mem_fault(vaddr, 1, false);
+		return so_env::MemoryRead8(vaddr);
+	}
+
+	std::uint16_t MemoryRead16(std::uint64_t vaddr) override {
+		guest_mem_fault(vaddr, 2, false);
+		return so_env::MemoryRead16(vaddr);
+	}
+
+	std::uint32_t MemoryRead32(std::uint64_t vaddr) override {
+		guest_mem_fault(vaddr, 4, false);
+		return so_env::MemoryRead32(vaddr);
+	}
+
+	std::uint64_t MemoryRead64(std::uint64_t vaddr) override {
+		guest_mem_fault(vaddr, 8, false);
+		return so_env::MemoryRead64(vaddr);
+	}
+
+	Dynarmic::A64::Vector MemoryRead128(std::uint64_t vaddr) override {
+		guest_mem_fault(vaddr, 16, false);
+		return so_env::MemoryRead128(vaddr);
+	}
+
+	void MemoryWrite8(std::uint64_t vaddr, std::uint8_t value) override {
+		if (guest_mem_fault(vaddr, 1, true))
+			so_env::MemoryWrite8(vaddr, value);
+	}
+
+	void MemoryWrite16(std::uint64_t vaddr, std::uint16_t value) override {
+		if (guest_mem_fault(vaddr, 2, true))
+			so_env::MemoryWrite16(vaddr, value);
+	}
+
+	void MemoryWrite32(std::uint64_t vaddr, std::uint32_t value) override {
+		if (guest_mem_fault(vaddr, 4, true))
+			so_env::MemoryWrite32(vaddr, value);
+	}
+
+	void MemoryWrite64(std::uint64_t vaddr, std::uint64_t value) override {
+		if (guest_mem_fault(vaddr, 8, true))
+			so_env::MemoryWrite64(vaddr, value);
+	}
+
+	void MemoryWrite128(std::uint64_t vaddr, Dynarmic::A64::Vector value) override {
+		if (guest_mem_fault(vaddr, 16, true))
+			so_env::MemoryWrite128(vaddr, value);
+	}
+};
+
 extern so_env so_dynarec_env;
+extern so_pt_env so_dynarec_pt_env;
 
 #endif
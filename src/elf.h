@@ -874,7 +874,10 @@ typedef struct
 #define DT_PREINIT_ARRAY 32		/* Array with addresses of preinit fct*/
 #define DT_PREINIT_ARRAYSZ 33		/* size in bytes of DT_PREINIT_ARRAY */
 #define DT_SYMTAB_SHNDX	34		/* Address of SYMTAB_SHNDX section */
-#define	DT_NUM		35		/* Number used */
+#define DT_RELRSZ	35		/* Total size of RELR relative relocations */
+#define DT_RELR		36		/* Address of RELR relative relocations */
+#define DT_RELRENT	37		/* Size of one RELR relative relocaction */
+#define	DT_NUM		38		/* Number used */
 #define DT_LOOS		0x6000000d	/* Start of OS-specific */
 #define DT_HIOS		0x6ffff000	/* End of OS-specific */
 #define DT_LOPROC	0x70000000	/* Start of processor-specific */
@@ -929,6 +932,16 @@ typedef struct
 #define DT_RELACOUNT	0x6ffffff9
 #define DT_RELCOUNT	0x6ffffffa
 
+/* Android specific: packed relocations ("APS2") and RELR tables emitted
+   before the generic tags were allocated.  */
+#define DT_ANDROID_REL	0x6000000f
+#define DT_ANDROID_RELSZ	0x60000010
+#define DT_ANDROID_RELA	0x60000011
+#define DT_ANDROID_RELASZ	0x60000012
+#define DT_ANDROID_RELR	0x6fffe000
+#define DT_ANDROID_RELRSZ	0x6fffe001
+#define DT_ANDROID_RELRENT	0x6fffe003
+
 /* These were chosen by Sun.  */
 #define DT_FLAGS_1	0x6ffffffb	/* State flags, see DF_1_* below.  */
 #define	DT_VERDEF	0x6ffffffc	/* Address of version definition
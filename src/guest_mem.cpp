@@ -0,0 +1,759 @@
+/* guest_mem.cpp -- guest address space and heap for the page table memory mode
+ *
+ * The region is reserved once and split in a static area (bump allocated, used for
+ * the ELF image, stacks and TPIDR blocks) and a heap area that grows on demand.
+ * Every committed page is identity mapped into guest_page_table so Dynarmic can
+ * translate guest accesses inline; anything else ends up in the memory callbacks.
+ *
+ * Guest stacks are handed out by guest_stack_alloc in every memory mode, and so is the
+ * guest heap, which lives at the end of the region or in a reservation of its own.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#ifdef __MINGW64__
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "dynarec.h"
+#include "so_util.h"
+#include "guest_mem.h"
+
+bool guest_mem_huge_pages = false;
+void **guest_page_table = nullptr;
+std::atomic<uint64_t> guest_mem_read_faults = 0;
+std::atomic<uint64_t> guest_mem_write_faults = 0;
+
+static uintptr_t region_base = 0;
+static std::atomic<uintptr_t> static_top = 0; // Moves under static_mutex, read by guest_mem_contains on any thread
+static uintptr_t heap_base = 0; // Slab area, grows by whole slabs
+static std::atomic<uintptr_t> slab_brk = 0; // Both brk pointers only move under their mutex but are read anywhere
+static uintptr_t large_base = 0; // Large object area, grows in commit chunks
+static std::atomic<uintptr_t> heap_brk = 0;
+static uintptr_t heap_limit = 0;
+
+static std::mutex static_mutex;
+static std::mutex heap_mutex;
+static std::map<uintptr_t, size_t> free_by_addr;
+static std::multimap<size_t, uintptr_t> free_by_size;
+static size_t heap_in_use = 0;
+
+typedef struct {
+	size_t size; // Block size, header included
+	size_t pad;
+} heap_block;
+
+static void *vm_reserve(uintptr_t hint, size_t size) {
+#ifdef __MINGW64__
+	void *res = VirtualAlloc((void *)hint, size, MEM_RESERVE, PAGE_NOACCESS);
+	if (!res)
+		res = VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+	return res;
+#else
+	void *res = mmap((void *)hint, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return res == MAP_FAILED ? NULL : res;
+#endif
+}
+
+#ifdef __MINGW64__
+static bool vm_enable_large_pages(void) {
+	HANDLE token;
+	TOKEN_PRIVILEGES tp;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+		return false;
+	tp.PrivilegeCount = 1;
+	tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	bool res = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid) &&
+		AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL) && GetLastError() == ERROR_SUCCESS;
+	CloseHandle(token);
+	return res;
+}
+#endif
+
+// Whole allocation backed by 2 MB pages. On Linux hugetlbfs pages are used when the system has
+// some reserved, transparent huge pages on a 2 MB aligned block otherwise. Windows needs the
+// "Lock pages in memory" privilege for large pages.
+static void *vm_alloc_huge(size_t size) {
+	size = ALIGN_MEM(size, GUEST_HUGE_PAGE_SIZE);
+#ifdef __MINGW64__
+	static bool privilege = vm_enable_large_pages();
+	size_t large_page = GetLargePageMinimum();
+	if (!privilege || !large_page)
+		return NULL;
+	return VirtualAlloc(NULL, ALIGN_MEM(size, large_page), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+#else
+	void *res = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (res != MAP_FAILED)
+		return res;
+
+	// Over-reserve, then trim to a huge page boundary
+	uintptr_t raw = (uintptr_t)mmap(NULL, size + GUEST_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (raw == (uintptr_t)MAP_FAILED)
+		return NULL;
+	uintptr_t start = ALIGN_MEM(raw, GUEST_HUGE_PAGE_SIZE);
+	if (start > raw)
+		munmap((void *)raw, start - raw);
+	if (raw + GUEST_HUGE_PAGE_SIZE > start)
+		munmap((void *)(start + size), raw + GUEST_HUGE_PAGE_SIZE - start);
+	madvise((void *)start, size, MADV_HUGEPAGE);
+	return (void *)start;
+#endif
+}
+
+static bool vm_commit(uintptr_t addr, size_t size) {
+#ifdef __MINGW64__
+	return VirtualAlloc((void *)addr, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#else
+	// Anonymous mappings are already readable/writable and faulted in lazily
+	return true;
+#endif
+}
+
+// Gives the backing memory back, the range stays reserved and reads as zero once committed again
+static void vm_decommit(uintptr_t addr, size_t size) {
+#ifdef __MINGW64__
+	VirtualFree((void *)addr, size, MEM_DECOMMIT);
+#else
+	madvise((void *)addr, size, MADV_DONTNEED);
+#endif
+}
+
+static void vm_release(uintptr_t addr, size_t size) {
+#ifdef __MINGW64__
+	VirtualFree((void *)addr, 0, MEM_RELEASE);
+#else
+	munmap((void *)addr, size);
+#endif
+}
+
+static bool vm_protect_none(uintptr_t addr, size_t size) {
+#ifdef __MINGW64__
+	// Reserved pages are inaccessible until committed, which never happens for guard pages
+	return true;
+#else
+	return mprotect((void *)addr, size, PROT_NONE) == 0;
+#endif
+}
+
+int guest_mem_init(void) {
+	region_base = (uintptr_t)vm_reserve(GUEST_REGION_BASE, GUEST_REGION_SIZE);
+	if (!region_base) {
+		printf("Failed to reserve guest address space\n");
+		return -1;
+	}
+	if (region_base + GUEST_REGION_SIZE > (1ULL << GUEST_PT_ADDRESS_BITS)) {
+		printf("Guest address space reserved too high (0x%llx), page table can't cover it\n", region_base);
+		return -1;
+	}
+
+	static_top.store(region_base, std::memory_order_release);
+
+	if (guest_mem_huge_pages) {
+#ifdef __MINGW64__
+		// Large pages can't be committed piecewise out of a reservation
+		printf("Huge pages are not available for the guest address space on Windows\n");
+#else
+		madvise((void *)region_base, GUEST_REGION_SIZE, MADV_HUGEPAGE);
+#endif
+	}
+
+	const size_t pt_size = sizeof(void *) << (GUEST_PT_ADDRESS_BITS - GUEST_PAGE_BITS);
+	guest_page_table = (void **)vm_reserve(0, pt_size);
+	if (!guest_page_table || !vm_commit((uintptr_t)guest_page_table, pt_size)) {
+		printf("Failed to allocate guest page table\n");
+		return -1;
+	}
+
+	debugLog("Guest address space reserved at 0x%llx (%llu MB)\n", region_base, GUEST_REGION_SIZE / (1024 * 1024));
+	return 0;
+}
+
+bool guest_mem_contains(uintptr_t addr, size_t size) {
+	return (addr >= region_base && addr + size <= static_top.load(std::memory_order_acquire)) || (addr >= heap_base && addr + size <= slab_brk.load(std::memory_order_relaxed)) ||
+		(addr >= large_base && addr + size <= heap_brk.load(std::memory_order_relaxed));
+}
+
+void guest_mem_map(uintptr_t addr, size_t size) {
+	if (!guest_page_table)
+		return;
+
+	for (uintptr_t page = addr & ~(GUEST_PAGE_SIZE - 1); page < addr + size; page += GUEST_PAGE_SIZE) {
+		if ((page >> GUEST_PT_ADDRESS_BITS) == 0)
+			guest_page_table[page >> GUEST_PAGE_BITS] = (void *)page;
+	}
+}
+
+// Size of the mapping backing a guest_mem_alloc block outside the guest region. Huge pages are only
+// used for allocations spanning at least one, anything smaller would waste most of it. Blocks that
+// had to fall back to regular pages are mapped with the same rounded size, so guest_mem_free
+// always unmaps exactly what was mapped.
+static size_t guest_mem_mapped_size(size_t size) {
+	size = ALIGN_MEM(size, GUEST_PAGE_SIZE);
+	if (guest_mem_huge_pages && size >= GUEST_HUGE_PAGE_SIZE)
+		size = ALIGN_MEM(size, GUEST_HUGE_PAGE_SIZE);
+	return size;
+}
+
+void *guest_mem_alloc(size_t size) {
+	if (!region_base) {
+		size = guest_mem_mapped_size(size);
+		if (guest_mem_huge_pages && size >= GUEST_HUGE_PAGE_SIZE) {
+			void *res = vm_alloc_huge(size);
+			if (res)
+				return res;
+			static bool warned = false;
+			if (!warned) {
+				printf("Warning: huge pages not available, falling back to regular pages\n");
+				warned = true;
+			}
+		}
+		void *res = vm_reserve(0, size);
+		if (res && !vm_commit((uintptr_t)res, size)) {
+			guest_mem_free(res, size);
+			return NULL;
+		}
+		return res;
+	}
+
+	size = ALIGN_MEM(size, GUEST_PAGE_SIZE);
+	std::lock_guard<std::mutex> lock(static_mutex);
+	uintptr_t top = static_top.load(std::memory_order_relaxed);
+	if (top + size > region_base + GUEST_STATIC_SIZE || !vm_commit(top, size)) {
+		printf("Failed to allocate %llu bytes of guest static memory\n", size);
+		return NULL;
+	}
+
+	void *res = (void *)top;
+	static_top.store(top + size, std::memory_order_release);
+	guest_mem_map((uintptr_t)res, size);
+	return res;
+}
+
+void guest_mem_free(void *ptr, size_t size) {
+	// Static guest memory is never given back while the region is in use
+	if (region_base)
+		return;
+#ifdef __MINGW64__
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+	munmap(ptr, guest_mem_mapped_size(size));
+#endif
+}
+
+/*
+ * Guest stacks: the usable stack is committed up front but only backed by memory once touched
+ * (committed pages are demand zero on both hosts), so a thread costs what its stack actually holds.
+ * Committing it all matters on Windows: host imports pass stack buffers to the kernel, whose probes
+ * of a reserved page fail without ever raising an exception we could handle. The guard area right
+ * below the stack is never accessible and turns an overflow into a report instead of silent
+ * corruption of whatever lies below. Freed stacks are decommitted and pooled for the next guest thread.
+ *
+ * guest_stack_fault runs in signal / exception handler context, so slots are only ever read
+ * through atomics there and a slot base never changes while the slot is in use.
+ */
+typedef struct {
+	std::atomic<uintptr_t> base; // Start of the guard area, 0 if the slot is free
+	std::atomic<size_t> size; // Usable size, guard excluded
+	bool in_use;
+} guest_stack_slot;
+
+static guest_stack_slot stack_slots[GUEST_STACKS_MAX];
+static std::mutex stack_mutex;
+static int stacks_pooled = 0;
+static uint64_t stack_pool_hits = 0;
+static uint64_t stack_pool_misses = 0;
+
+// Returns the lowest usable address of a stack of at least size bytes, stack pointer starts at the top
+uint8_t *guest_stack_alloc(size_t size) {
+	size = ALIGN_MEM(size, GUEST_STACK_SIZE_ALIGN);
+	std::lock_guard<std::mutex> lock(stack_mutex);
+
+	guest_stack_slot *free_slot = NULL;
+	for (auto &slot : stack_slots) {
+		if (!slot.base) {
+			if (!free_slot)
+				free_slot = &slot;
+		} else if (!slot.in_use && slot.size == size) {
+			if (!vm_commit(slot.base + GUEST_STACK_GUARD_SIZE, size)) {
+				printf("Failed to commit guest stack at 0x%llx\n", slot.base + GUEST_STACK_GUARD_SIZE);
+				return NULL;
+			}
+			slot.in_use = true;
+			stacks_pooled--;
+			stack_pool_hits++;
+			return (uint8_t *)(slot.base + GUEST_STACK_GUARD_SIZE);
+		}
+	}
+	if (!free_slot) {
+		printf("Failed to allocate guest stack, %d stacks already in use\n", GUEST_STACKS_MAX);
+		return NULL;
+	}
+
+	size_t total = size + GUEST_STACK_GUARD_SIZE;
+	uintptr_t base;
+	if (region_base) {
+		// Taken from the static area like guest_mem_alloc does, the stack gets committed below
+		std::lock_guard<std::mutex> static_lock(static_mutex);
+		base = static_top.load(std::memory_order_relaxed);
+		if (base + total > region_base + GUEST_STATIC_SIZE) {
+			printf("Failed to allocate %llu bytes of guest static memory\n", total);
+			return NULL;
+		}
+		static_top.store(base + total, std::memory_order_release);
+		guest_mem_map(base + GUEST_STACK_GUARD_SIZE, size);
+	} else {
+		base = (uintptr_t)vm_reserve(0, total);
+		if (!base) {
+			printf("Failed to reserve %llu bytes for guest stack\n", total);
+			return NULL;
+		}
+	}
+	if (!vm_protect_none(base, GUEST_STACK_GUARD_SIZE))
+		printf("Failed to protect guard area of guest stack at 0x%llx\n", base);
+	if (!vm_commit(base + GUEST_STACK_GUARD_SIZE, size)) {
+		printf("Failed to commit guest stack at 0x%llx\n", base + GUEST_STACK_GUARD_SIZE);
+		if (region_base) {
+			// Static guest memory can't be given back, pool the reservation for a later attempt
+			free_slot->size = size;
+			free_slot->in_use = false;
+			free_slot->base = base;
+			stacks_pooled++;
+		} else {
+			vm_release(base, total);
+		}
+		return NULL;
+	}
+
+	free_slot->size = size;
+	free_slot->in_use = true;
+	free_slot->base = base;
+	stack_pool_misses++;
+	debugLog("Guest stack reserved at 0x%llx (%llu KB)\n", base + GUEST_STACK_GUARD_SIZE, size / 1024);
+	return (uint8_t *)(base + GUEST_STACK_GUARD_SIZE);
+}
+
+void guest_stack_free(uint8_t *stack) {
+	uintptr_t base = (uintptr_t)stack - GUEST_STACK_GUARD_SIZE;
+	std::lock_guard<std::mutex> lock(stack_mutex);
+	for (auto &slot : stack_slots) {
+		if (slot.base != base || !slot.in_use)
+			continue;
+		vm_decommit((uintptr_t)stack, slot.size);
+		slot.in_use = false;
+		// Static guest memory is never given back, so stacks taken from it always stay pooled
+		if (stacks_pooled >= GUEST_STACK_POOL_MAX && !region_base) {
+			size_t size = slot.size;
+			slot.base = 0;
+			vm_release(base, size + GUEST_STACK_GUARD_SIZE);
+		} else {
+			stacks_pooled++;
+		}
+		return;
+	}
+	printf("Attempted to free unknown guest stack 0x%llx\n", stack);
+}
+
+// Reports overflows into a guard area
+bool guest_stack_fault(uintptr_t addr) {
+	for (auto &slot : stack_slots) {
+		uintptr_t base = slot.base.load();
+		if (!base || addr < base || addr >= base + GUEST_STACK_GUARD_SIZE + slot.size)
+			continue;
+		if (addr < base + GUEST_STACK_GUARD_SIZE) {
+			printf("Guest stack overflow: access at 0x%llx hit the guard area of stack 0x%llx-0x%llx\n",
+				addr, base + GUEST_STACK_GUARD_SIZE, base + GUEST_STACK_GUARD_SIZE + slot.size);
+			fflush(stdout);
+			abort();
+		}
+		return false;
+	}
+	return false;
+}
+
+// Called for every guest access the page table couldn't translate. Reads of host owned
+// memory (eg. strings returned by native imports) are let through, stray writes are not.
+bool guest_mem_fault(uint64_t vaddr, size_t size, bool is_write) {
+	if (!is_write) {
+		guest_mem_read_faults++;
+		return true;
+	}
+
+	guest_mem_write_faults++;
+	if (guest_mem_contains(vaddr, size))
+		return true;
+
+	printf("Guest write of %llu bytes outside guest memory at 0x%llx (PC: 0x%llx)\n", size, vaddr, so_dynarec->GetPC() - (uintptr_t)dynarec_base_addr);
+	so_dynarec->HaltExecution(Dynarmic::HaltReason::MemoryAbort);
+	return false;
+}
+
+void guest_mem_print_stats(void) {
+	printf("Guest memory: %llu read faults, %llu write faults\n", guest_mem_read_faults.load(), guest_mem_write_faults.load());
+	printf("Guest stacks: %llu reserved, %llu reused from pool, %d pooled\n", stack_pool_misses, stack_pool_hits, stacks_pooled);
+}
+
+/*
+ * Guest heap: requests up to GUEST_HEAP_SMALL_MAX bytes are served from size class slabs in the
+ * low part of the heap, bigger ones by a best fit allocator over the rest. Every guest thread has
+ * a cache of free objects per size class, so the common malloc/free pair takes no lock at all;
+ * caches refill from and spill to the per class free lists in batches.
+ */
+#define HEAP_SLAB_HEADER_SIZE (64) // Keeps objects 16 bytes aligned
+#define HEAP_TCACHE_BATCH (32) // Objects moved between a thread cache and its class at once
+#define HEAP_TCACHE_MAX (64) // Objects of a class a thread cache holds before spilling
+
+typedef struct {
+	uint32_t size_class;
+} heap_slab;
+
+typedef struct {
+	std::mutex lock;
+	void *free_list; // Linked through the first word of every object
+	uintptr_t bump; // Unused tail of the newest slab
+	uintptr_t bump_end;
+	uint64_t slabs;
+} heap_class;
+
+static const uint32_t heap_class_sizes[GUEST_HEAP_CLASSES] = {
+	16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+	320, 384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048
+};
+static uint8_t heap_class_lookup[GUEST_HEAP_SMALL_MAX / 16 + 1]; // Indexed by size rounded up to 16 bytes
+static heap_class heap_classes[GUEST_HEAP_CLASSES];
+static std::mutex slab_mutex;
+
+struct heap_tcache;
+static std::mutex tcache_mutex;
+static std::vector<heap_tcache *> tcaches;
+static uint64_t retired_allocs[GUEST_HEAP_CLASSES];
+static uint64_t retired_frees[GUEST_HEAP_CLASSES];
+
+static void heap_spill(heap_tcache *tc, int cls, uint32_t num);
+
+struct heap_tcache {
+	void *head[GUEST_HEAP_CLASSES] = {};
+	uint32_t count[GUEST_HEAP_CLASSES] = {};
+	uint64_t allocs[GUEST_HEAP_CLASSES] = {}; // Only written by the owning thread, read for stats
+	uint64_t frees[GUEST_HEAP_CLASSES] = {};
+
+	heap_tcache() {
+		std::lock_guard<std::mutex> lock(tcache_mutex);
+		tcaches.push_back(this);
+	}
+
+	~heap_tcache() {
+		std::lock_guard<std::mutex> lock(tcache_mutex);
+		for (int i = 0; i < GUEST_HEAP_CLASSES; i++) {
+			heap_spill(this, i, count[i]);
+			retired_allocs[i] += allocs[i];
+			retired_frees[i] += frees[i];
+		}
+		tcaches.erase(std::find(tcaches.begin(), tcaches.end(), this));
+	}
+};
+
+static thread_local heap_tcache tcache;
+
+int guest_heap_init(void) {
+	uintptr_t start;
+	size_t size;
+	if (region_base) {
+		start = region_base + GUEST_STATIC_SIZE;
+		size = GUEST_REGION_SIZE - GUEST_STATIC_SIZE;
+	} else {
+		// Kept in one place regardless of the memory mode, so the guest heap stays compact
+		size = GUEST_HEAP_SIZE + GUEST_SLAB_SIZE;
+		start = (uintptr_t)vm_reserve(0, size);
+		if (!start) {
+			printf("Failed to reserve guest heap\n");
+			return -1;
+		}
+#ifndef __MINGW64__
+		if (guest_mem_huge_pages)
+			madvise((void *)start, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	heap_base = slab_brk = ALIGN_MEM(start, GUEST_SLAB_SIZE);
+	large_base = heap_brk = heap_base + GUEST_HEAP_SLAB_AREA_SIZE;
+	heap_limit = start + size;
+
+	for (int i = 0, cls = 0; i <= GUEST_HEAP_SMALL_MAX / 16; i++) {
+		while (heap_class_sizes[cls] < i * 16)
+			cls++;
+		heap_class_lookup[i] = cls;
+	}
+
+	debugLog("Guest heap at 0x%llx (%llu MB)\n", heap_base, (heap_limit - heap_base) / (1024 * 1024));
+	return 0;
+}
+
+static bool heap_new_slab(int cls) {
+	heap_class *c = &heap_classes[cls];
+	uintptr_t slab;
+	{
+		std::lock_guard<std::mutex> lock(slab_mutex);
+		if (slab_brk + GUEST_SLAB_SIZE > large_base || !vm_commit(slab_brk, GUEST_SLAB_SIZE))
+			return false;
+		slab = slab_brk;
+		slab_brk += GUEST_SLAB_SIZE;
+	}
+	guest_mem_map(slab, GUEST_SLAB_SIZE);
+
+	((heap_slab *)slab)->size_class = cls;
+	c->bump = slab + HEAP_SLAB_HEADER_SIZE;
+	c->bump_end = slab + GUEST_SLAB_SIZE;
+	c->slabs++;
+	return true;
+}
+
+// Moves up to a batch of objects of a class into the calling thread cache
+static bool heap_refill(heap_tcache *tc, int cls) {
+	heap_class *c = &heap_classes[cls];
+	const uint32_t obj_size = heap_class_sizes[cls];
+	std::lock_guard<std::mutex> lock(c->lock);
+
+	uint32_t num = 0;
+	while (num < HEAP_TCACHE_BATCH && c->free_list) {
+		void *obj = c->free_list;
+		c->free_list = *(void **)obj;
+		*(void **)obj = tc->head[cls];
+		tc->head[cls] = obj;
+		num++;
+	}
+	if (!num && c->bump + obj_size > c->bump_end && !heap_new_slab(cls))
+		return false;
+	while (num < HEAP_TCACHE_BATCH && c->bump + obj_size <= c->bump_end) {
+		void *obj = (void *)c->bump;
+		c->bump += obj_size;
+		*(void **)obj = tc->head[cls];
+		tc->head[cls] = obj;
+		num++;
+	}
+
+	tc->count[cls] += num;
+	return true;
+}
+
+// Gives num objects of a class back from a thread cache
+static void heap_spill(heap_tcache *tc, int cls, uint32_t num) {
+	if (!num)
+		return;
+	heap_class *c = &heap_classes[cls];
+	std::lock_guard<std::mutex> lock(c->lock);
+	for (uint32_t i = 0; i < num; i++) {
+		void *obj = tc->head[cls];
+		tc->head[cls] = *(void **)obj;
+		*(void **)obj = c->free_list;
+		c->free_list = obj;
+	}
+	tc->count[cls] -= num;
+}
+
+static void *heap_alloc_small(size_t size) {
+	const int cls = heap_class_lookup[(size + 15) >> 4];
+	heap_tcache *tc = &tcache;
+	if (!tc->head[cls] && !heap_refill(tc, cls))
+		return NULL;
+
+	void *res = tc->head[cls];
+	tc->head[cls] = *(void **)res;
+	tc->count[cls]--;
+	tc->allocs[cls]++;
+	return res;
+}
+
+static void heap_free_small(void *ptr) {
+	const int cls = ((heap_slab *)((uintptr_t)ptr & ~(GUEST_SLAB_SIZE - 1)))->size_class;
+	heap_tcache *tc = &tcache;
+	*(void **)ptr = tc->head[cls];
+	tc->head[cls] = ptr;
+	tc->count[cls]++;
+	tc->frees[cls]++;
+	if (tc->count[cls] > HEAP_TCACHE_MAX)
+		heap_spill(tc, cls, HEAP_TCACHE_BATCH);
+}
+
+static inline bool heap_is_small(uintptr_t addr) {
+	return addr >= heap_base && addr < slab_brk.load(std::memory_order_relaxed);
+}
+
+static inline bool heap_is_large(uintptr_t addr) {
+	return addr >= large_base && addr < heap_brk.load(std::memory_order_relaxed);
+}
+
+static void heap_insert_free(uintptr_t addr, size_t size) {
+	// Merge with the following free block
+	auto next = free_by_addr.find(addr + size);
+	if (next != free_by_addr.end()) {
+		auto range = free_by_size.equal_range(next->second);
+		for (auto it = range.first; it != range.second; ++it) {
+			if (it->second == next->first) {
+				free_by_size.erase(it);
+				break;
+			}
+		}
+		size += next->second;
+		free_by_addr.erase(next);
+	}
+
+	// Merge with the preceding free block
+	auto prev = free_by_addr.lower_bound(addr);
+	if (prev != free_by_addr.begin()) {
+		--prev;
+		if (prev->first + prev->second == addr) {
+			auto range = free_by_size.equal_range(prev->second);
+			for (auto it = range.first; it != range.second; ++it) {
+				if (it->second == prev->first) {
+					free_by_size.erase(it);
+					break;
+				}
+			}
+			addr = prev->first;
+			size += prev->second;
+			free_by_addr.erase(prev);
+		}
+	}
+
+	free_by_addr[addr] = size;
+	free_by_size.insert({size, addr});
+}
+
+static bool heap_grow(size_t min_size) {
+	size_t grow = ALIGN_MEM(min_size, guest_mem_huge_pages ? GUEST_HUGE_PAGE_SIZE : GUEST_HEAP_COMMIT_CHUNK);
+	if (grow > heap_limit - heap_brk || !vm_commit(heap_brk, grow))
+		return false;
+
+	guest_mem_map(heap_brk, grow);
+	heap_insert_free(heap_brk, grow);
+	heap_brk += grow;
+	return true;
+}
+
+static void *heap_alloc_large(size_t size) {
+	// Anything bigger than the large object area can't be served, and would wrap around below
+	if (size > heap_limit - large_base - sizeof(heap_block) - 15) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	const size_t need = ALIGN_MEM(size + sizeof(heap_block), 16);
+	std::lock_guard<std::mutex> lock(heap_mutex);
+
+	auto it = free_by_size.lower_bound(need);
+	if (it == free_by_size.end()) {
+		if (!heap_grow(need))
+			return NULL;
+		it = free_by_size.lower_bound(need);
+	}
+
+	uintptr_t addr = it->second;
+	size_t block_size = it->first;
+	free_by_size.erase(it);
+	free_by_addr.erase(addr);
+
+	// Split the block if the remainder is big enough to be useful
+	if (block_size - need >= 2 * sizeof(heap_block)) {
+		heap_insert_free(addr + need, block_size - need);
+		block_size = need;
+	}
+
+	heap_block *blk = (heap_block *)addr;
+	blk->size = block_size;
+	heap_in_use += block_size;
+	return (void *)(addr + sizeof(heap_block));
+}
+
+static void heap_free_large(void *ptr) {
+	heap_block *blk = (heap_block *)((uintptr_t)ptr - sizeof(heap_block));
+	std::lock_guard<std::mutex> lock(heap_mutex);
+	heap_in_use -= blk->size;
+	heap_insert_free((uintptr_t)blk, blk->size);
+}
+
+void *guest_malloc(size_t size) {
+	void *res = size <= GUEST_HEAP_SMALL_MAX ? heap_alloc_small(size) : heap_alloc_large(size);
+	if (!res)
+		printf("Failed to allocate %llu bytes of guest heap\n", size);
+	return res;
+}
+
+void *guest_calloc(size_t num, size_t size) {
+	if (size && num > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	void *res = guest_malloc(num * size);
+	if (res)
+		memset(res, 0, num * size);
+	return res;
+}
+
+void guest_free(void *ptr) {
+	if (!ptr)
+		return;
+
+	if (heap_is_small((uintptr_t)ptr))
+		heap_free_small(ptr);
+	else if (heap_is_large((uintptr_t)ptr))
+		heap_free_large(ptr);
+	else // Memory allocated by the host on behalf of the guest
+		free(ptr);
+}
+
+void *guest_realloc(void *ptr, size_t size) {
+	if (!ptr)
+		return guest_malloc(size);
+
+	size_t old_size;
+	if (heap_is_small((uintptr_t)ptr))
+		old_size = heap_class_sizes[((heap_slab *)((uintptr_t)ptr & ~(GUEST_SLAB_SIZE - 1)))->size_class];
+	else if (heap_is_large((uintptr_t)ptr))
+		old_size = ((heap_block *)((uintptr_t)ptr - sizeof(heap_block)))->size - sizeof(heap_block);
+	else
+		return realloc(ptr, size);
+	if (size <= old_size)
+		return ptr;
+
+	void *res = guest_malloc(size);
+	if (res) {
+		memcpy(res, ptr, old_size);
+		guest_free(ptr);
+	}
+	return res;
+}
+
+// Thread caches are read without synchronization, so live objects are approximate while guest threads run
+void guest_heap_print_stats(void) {
+	uint64_t allocs[GUEST_HEAP_CLASSES];
+	uint64_t frees[GUEST_HEAP_CLASSES];
+	{
+		std::lock_guard<std::mutex> lock(tcache_mutex);
+		for (int i = 0; i < GUEST_HEAP_CLASSES; i++) {
+			allocs[i] = retired_allocs[i];
+			frees[i] = retired_frees[i];
+			for (heap_tcache *tc : tcaches) {
+				allocs[i] += tc->allocs[i];
+				frees[i] += tc->frees[i];
+			}
+		}
+	}
+
+	printf("Guest heap: %llu KB in slabs, large objects %llu KB in use (%llu KB committed)\n",
+		(slab_brk.load() - heap_base) / 1024, heap_in_use / 1024, (heap_brk.load() - large_base) / 1024);
+	for (int i = 0; i < GUEST_HEAP_CLASSES; i++) {
+		if (!heap_classes[i].slabs)
+			continue;
+		printf("  %4u bytes: %llu slabs, %llu live, %llu allocs, %llu frees\n", heap_class_sizes[i],
+			heap_classes[i].slabs, allocs[i] - frees[i], allocs[i], frees[i]);
+	}
+}
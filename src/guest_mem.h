@@ -0,0 +1,55 @@
+#ifndef _GUEST_MEM_H_
+#define _GUEST_MEM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// Guest address space used by the page table memory mode. Everything the guest is
+// allowed to touch (ELF image, stack, TPIDR block and heap) is carved out of a single
+// reserved region so that a small software page table can describe it.
+#define GUEST_REGION_BASE (0x100000000ULL) // Preferred placement, keeps the region below 2^33
+#define GUEST_REGION_SIZE (0x80000000ULL) // 2 GB
+#define GUEST_STATIC_SIZE (0x20000000ULL) // First 512 MB hold image, stacks and TPIDR blocks, the rest is heap
+#define GUEST_HEAP_COMMIT_CHUNK (0x100000) // Large object heap grows in 1 MB steps
+#define GUEST_HEAP_SIZE (0x40000000ULL) // 1 GB, reserved for the heap when there is no guest region
+#define GUEST_HEAP_SLAB_AREA_SIZE (0x10000000ULL) // First 256 MB of the heap hold size class slabs
+#define GUEST_HEAP_SMALL_MAX (2048) // Largest request served from slabs
+#define GUEST_HEAP_CLASSES (24)
+#define GUEST_SLAB_SIZE (0x10000ULL) // 64 KB, slabs are aligned to their size
+#define GUEST_PAGE_BITS (12)
+#define GUEST_PAGE_SIZE (1ULL << GUEST_PAGE_BITS)
+#define GUEST_PT_ADDRESS_BITS (33)
+#define GUEST_HUGE_PAGE_SIZE (0x200000ULL) // 2 MB
+#define GUEST_STACK_GUARD_SIZE (0x10000) // Inaccessible area below every stack, a multiple of any host page size
+#define GUEST_STACK_SIZE_ALIGN (0x10000) // Stack sizes are rounded up to 64 KB
+#define GUEST_STACKS_MAX (128) // Guest stacks alive at once, idle pooled ones included
+#define GUEST_STACK_POOL_MAX (16) // Idle stacks kept around for new guest threads
+
+extern bool guest_mem_huge_pages; // Back guest memory with huge pages, see vm_alloc_huge
+extern void **guest_page_table;
+extern std::atomic<uint64_t> guest_mem_read_faults;
+extern std::atomic<uint64_t> guest_mem_write_faults;
+
+int guest_mem_init(void);
+bool guest_mem_contains(uintptr_t addr, size_t size);
+void *guest_mem_alloc(size_t size); // Page granular, zero filled
+void guest_mem_free(void *ptr, size_t size);
+void guest_mem_map(uintptr_t addr, size_t size);
+bool guest_mem_fault(uint64_t vaddr, size_t size, bool is_write);
+void guest_mem_print_stats(void);
+
+// Guest stacks, see guest_stack_alloc
+uint8_t *guest_stack_alloc(size_t size);
+void guest_stack_free(uint8_t *stack);
+bool guest_stack_fault(uintptr_t addr);
+
+// Guest heap, used for guest malloc family imports
+int guest_heap_init(void);
+void guest_heap_print_stats(void);
+void *guest_malloc(size_t size);
+void *guest_calloc(size_t num, size_t size);
+void *guest_realloc(void *ptr, size_t size);
+void guest_free(void *ptr);
+
+#endif
@@ -14,3 +14,7 @@
 #include <mcl/stdint.hpp>
 
 extern uc_engine *uc;
+
+// Identity maps host memory into uc, see unmappedMemoryHook
+bool so_uc_map(uintptr_t start, size_t size);
+void so_uc_unmap(uintptr_t start, size_t size);
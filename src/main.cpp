@@ -3,11 +3,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "dynarec.h"
 #include "so_util.h"
 #include "port.h"
+#include "bench.h"
+#include "aarch64_pthread.h"
 
 #ifdef USE_INTERPRETER
 #include "interpreter.h"
@@ -49,47 +52,134 @@ bool initOpenGL(int major_ver, int minor_ver) {
 }
 
 int setupDynarec() {
-	so_stack = (uint8_t *)memalign(0x1000, ALIGN_MEM(DYNAREC_STACK_SIZE, 0x1000));
-	tpidr_el0 = (uint8_t *)memalign(0x1000, ALIGN_MEM(DYNAREC_TPIDR_SIZE, 0x1000));
-	memset(tpidr_el0, 0, DYNAREC_TPIDR_SIZE);
-	memset(so_stack, 0, DYNAREC_STACK_SIZE);
+#ifndef USE_INTERPRETER
+	if (so_mem_mode == DYNAREC_MEM_PAGETABLE && guest_mem_init()) {
+		printf("Failed to setup guest address space\n");
+		return -1;
+	}
+#endif
+	if (guest_heap_init())
+		return -1;
+	so_stack = guest_stack_alloc(DYNAREC_STACK_SIZE);
+	if (!so_stack) {
+		printf("Failed to allocate guest stack\n");
+		return -1;
+	}
+	so_install_fault_handler();
 #ifdef USE_INTERPRETER
 	uc_err err = uc_open(UC_ARCH_ARM64, UC_MODE_ARM, &uc);
 	if (err) {
 		printf("Failed to setup interpreter with error returned: %u (%s)\n", err, uc_strerror(err));
 		return -1;
 	}
-	err = uc_mem_map_ptr(uc, (uintptr_t)so_stack, ALIGN_MEM(DYNAREC_STACK_SIZE, 0x1000), UC_PROT_ALL, so_stack);
-	if (err) {
-		printf("Failed to map stack with error returned: %u (%s)\n", err, uc_strerror(err));
-		return -1;
-	}
-	err = uc_mem_map_ptr(uc, (uintptr_t)tpidr_el0, ALIGN_MEM(DYNAREC_TPIDR_SIZE, 0x1000), UC_PROT_ALL, tpidr_el0);
-	if (err) {
-		printf("Failed to map TPIDR EL0 region with error returned: %u (%s)\n", err, uc_strerror(err));
+	if (!so_uc_map((uintptr_t)so_stack, DYNAREC_STACK_SIZE)) {
+		printf("Failed to map stack\n");
 		return -1;
 	}
 	uintptr_t sp = (uintptr_t)so_stack + DYNAREC_STACK_SIZE - 8;
-	uintptr_t tpidr_el0_ptr = (uintptr_t)tpidr_el0;
 	uc_reg_write(uc, UC_ARM64_REG_SP, &sp);
-	uc_reg_write(uc, UC_ARM64_REG_TPIDR_EL0, &tpidr_el0_ptr);
-	uc_reg_write(uc, UC_ARM64_REG_TPIDRRO_EL0, &tpidr_el0_ptr);
 #else
-	so_monitor = new Dynarmic::ExclusiveMonitor(1);
-	so_dynarec_cfg.fastmem_pointer = (uintptr_t)nullptr;
+	so_monitor = new Dynarmic::ExclusiveMonitor(DYNAREC_MAX_PROCESSORS);
+	if (so_mem_mode == DYNAREC_MEM_PAGETABLE) {
+		// Only guest memory is reachable inline, the rest goes through so_pt_env
+		so_dynarec_cfg.page_table = guest_page_table;
+		so_dynarec_cfg.page_table_address_space_bits = GUEST_PT_ADDRESS_BITS;
+		so_dynarec_cfg.silently_mirror_page_table = false;
+		so_dynarec_cfg.absolute_offset_page_table = false;
+		so_dynarec_cfg.fastmem_pointer = std::nullopt;
+	} else if (so_mem_mode == DYNAREC_MEM_FASTMEM) {
+		// Guest addresses are host addresses, so the whole host address space acts as the
+		// fastmem arena. Faulting accesses are redirected to the Memory* callbacks by Dynarmic
+		// and the offending block is recompiled without fastmem.
+		so_dynarec_cfg.fastmem_pointer = (uintptr_t)0;
+		so_dynarec_cfg.fastmem_address_space_bits = 64;
+		so_dynarec_cfg.silently_mirror_fastmem = false;
+		so_dynarec_cfg.recompile_on_fastmem_failure = true;
+		so_dynarec_cfg.fastmem_exclusive_access = true;
+		so_dynarec_cfg.recompile_on_exclusive_fastmem_failure = true;
+	} else {
+		so_dynarec_cfg.fastmem_pointer = std::nullopt;
+	}
+	// Whole huge pages, so that the code cache can be backed by them if the host allows it
+	if (guest_mem_huge_pages)
+		so_code_cache_size = ALIGN_MEM(so_code_cache_size, GUEST_HUGE_PAGE_SIZE);
+	so_dynarec_cfg.code_cache_size = so_code_cache_size;
 	so_dynarec_cfg.enable_cycle_counting = false;
 	so_dynarec_cfg.global_monitor = so_monitor;
-	so_dynarec_cfg.callbacks = &so_dynarec_env;
-	so_dynarec_cfg.tpidrro_el0 = (uint64_t *)tpidr_el0;
-	so_dynarec_cfg.tpidr_el0 = (uint64_t *)tpidr_el0;
+	so_dynarec_cfg.processor_id = 0;
+	so_dynarec_cfg.callbacks = so_mem_mode == DYNAREC_MEM_PAGETABLE ? &so_dynarec_pt_env : &so_dynarec_env;
+	// Dynarmic config expects pointers to the register storage, not the register value itself.
+	// The TLS block only gets allocated once the modules are loaded, see setupThreadLocalStorage
+	so_dynarec_cfg.tpidrro_el0 = &tpidr_el0_reg;
+	so_dynarec_cfg.tpidr_el0 = &tpidr_el0_reg;
 	so_dynarec = new Dynarmic::A64::Jit(so_dynarec_cfg);
-	printf("AARCH64 dynarec inited with address: 0x%llx and TPIDR EL0 pointing at: 0x%llx\n", so_dynarec, tpidr_el0);
+	so_jit_register(so_dynarec, so_dynarec_cfg.processor_id);
+	printf("AARCH64 dynarec inited with address: 0x%llx\n", so_dynarec);
+	printf("Guest memory mode: %s%s, code cache: %llu MB\n", so_mem_mode_name(), guest_mem_huge_pages ? " (huge pages)" : "", so_code_cache_size / (1024 * 1024));
 	so_dynarec->SetSP((uintptr_t)so_stack + DYNAREC_STACK_SIZE - 8);
 #endif
 	return 0;
 }
 
-int main() {
+// TLS block of the main guest thread, laid out after the PT_TLS segments of the loaded modules
+int setupThreadLocalStorage() {
+	tpidr_el0_reg = so_tls_alloc();
+	if (!tpidr_el0_reg)
+		return -1;
+	tpidr_el0 = (uint8_t *)tpidr_el0_reg;
+#ifdef USE_INTERPRETER
+	uc_reg_write(uc, UC_ARM64_REG_TPIDR_EL0, &tpidr_el0_reg);
+	uc_reg_write(uc, UC_ARM64_REG_TPIDRRO_EL0, &tpidr_el0_reg);
+#endif
+	printf("TPIDR EL0 pointing at: 0x%llx\n", tpidr_el0_reg);
+	return 0;
+}
+
+static bool use_image_cache = true;
+
+void parseArgs(int argc, char *argv[]) {
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--mem-mode=fastmem")) {
+			so_mem_mode = DYNAREC_MEM_FASTMEM;
+		} else if (!strcmp(argv[i], "--mem-mode=callbacks")) {
+			so_mem_mode = DYNAREC_MEM_CALLBACKS;
+		} else if (!strcmp(argv[i], "--mem-mode=pagetable")) {
+			so_mem_mode = DYNAREC_MEM_PAGETABLE;
+		} else if (!strncmp(argv[i], "--bench=", 8)) {
+			bench_name = argv[i] + 8;
+		} else if (!strcmp(argv[i], "--lazy-binding")) {
+			so_lazy_binding = true;
+		} else if (!strcmp(argv[i], "--huge-pages")) {
+			guest_mem_huge_pages = true;
+		} else if (!strncmp(argv[i], "--code-cache-mb=", 16)) {
+			int mb = atoi(argv[i] + 16);
+			if (mb < 1 || mb > DYNAREC_CODE_CACHE_MAX_MB)
+				printf("Invalid code cache size: %s (1 to %d MB), keeping %llu MB\n", argv[i] + 16, DYNAREC_CODE_CACHE_MAX_MB, so_code_cache_size / (1024 * 1024));
+			else
+				so_code_cache_size = (size_t)mb * 1024 * 1024;
+		} else if (!strcmp(argv[i], "--no-image-cache")) {
+			use_image_cache = false;
+		} else if (!strncmp(argv[i], "--bench-frames=", 15)) {
+			bench_frames_interval = atoi(argv[i] + 15);
+		} else {
+			printf("Unknown argument: %s\n", argv[i]);
+			printf("Usage: %s [--mem-mode=callbacks|fastmem|pagetable] [--bench-frames=N] [--bench=memory|atomics|hostcall|tlb|heap|mutex|threads|smc] [--huge-pages] [--code-cache-mb=N] [--no-image-cache] [--lazy-binding]\n", argv[0]);
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	parseArgs(argc, argv);
+
+	// Microbenchmarks only need the dynarec, run them and leave
+	if (bench_name) {
+		if (setupDynarec()) {
+			printf("Failed to init dynarec\n");
+			return -1;
+		}
+		return bench_run(bench_name);
+	}
+
 	// Initialize OpenGL
 	printf("Initializing OpenGL %d.%d...\n", OPENGL_MAJOR_VER, OPENGL_MINOR_VER);
 	if (!initOpenGL(OPENGL_MAJOR_VER, OPENGL_MINOR_VER)) {
@@ -117,16 +207,36 @@ int main() {
 	
 	// Relocate jumps and function calls to our dynarec virtual addresses
 	printf("Executing relocations and imports resolving...\n");
-	so_relocate();
-	so_resolve(dynarec_imports, dynarec_imports_num);
+	uint64_t reloc_start = bench_now_ns();
+	// Lazily bound images are never cached, slots would be bound eagerly when restored
+	if (so_lazy_binding)
+		use_image_cache = false;
+	if (use_image_cache && so_cache_load() == 0) {
+		printf("Relocated images restored from cache in %.3f ms\n", (bench_now_ns() - reloc_start) / 1e6);
+	} else {
+		so_relocate();
+		uint64_t resolve_start = bench_now_ns();
+		int resolved = so_resolve();
+		uint64_t resolve_end = bench_now_ns();
+		printf("Relocations applied in %.3f ms, %d imports resolved in %.3f ms\n",
+			(resolve_start - reloc_start) / 1e6, resolved, (resolve_end - resolve_start) / 1e6);
+		if (use_image_cache)
+			so_cache_save();
+	}
+	
+	if (setupThreadLocalStorage()) {
+		printf("FATAL ERROR: Failed to allocate TLS block\n");
+		return -1;
+	}
+	aarch64_thread_pool_init(DYNAREC_JIT_POOL_PREBUILT);
 	
 	// Execute hook patches
 	printf("Applying hook patches...\n");
 	exec_patch_hooks(dynarec_base_addr);
 	
-	// Flush dynarec cache
-	printf("Flushing dynarec code cache...\n");
-	so_flush_caches();
+	// Hooks invalidate what they patch, text is read-only from here on
+	printf("Write protecting guest code...\n");
+	so_protect_text();
 	
 	// Init static arrays
 	printf("Initing static arrays...\n");
@@ -146,6 +256,13 @@ int main() {
 		ret = exec_main_loop(dynarec_base_addr);
 	}
   
+	if (so_mem_mode == DYNAREC_MEM_PAGETABLE)
+		guest_mem_print_stats();
+#ifndef NDEBUG
+	guest_heap_print_stats();
+#endif
+	if (so_lazy_binding)
+		printf("Lazy binding: %d of %d PLT slots used\n", so_lazy_bound.load(), so_lazy_slots.load());
 	printf("Exiting with code %d\n", ret);
 	glfwTerminate();	
 	return 0;
@@ -12,6 +12,7 @@
 #include "port.h"
 #include "variadics.h"
 #include "aarch64_pthread.h"
+#include "bench.h"
 
 #define AL_ALEXT_PROTOTYPES
 #include <AL/al.h>
@@ -113,7 +114,8 @@ int ret0() {
  * List of imports to be resolved with native variants
  */
 #define WRAP_FUNC(name, func) gen_wrapper<&func>(name)
-dynarec_import dynarec_imports[] = {
+#define WRAP_FUNC_NESTED(name, func) gen_wrapper<&func>(name, true)
+constexpr dynarec_thunk dynarec_imports[] = {
 	WRAP_FUNC("__android_log_print", __android_log_print),
 	WRAP_FUNC("__ctype_get_mb_cur_max", __ctype_get_mb_cur_max),
 	WRAP_FUNC("__cxa_atexit", __aarch64__cxa_atexit),
@@ -136,7 +138,7 @@ dynarec_import dynarec_imports[] = {
 	WRAP_FUNC("atoi", atoi),
 	WRAP_FUNC("bsearch", __aarch64_bsearch),
 	WRAP_FUNC("btowc", btowc),
-	WRAP_FUNC("calloc", calloc),
+	WRAP_FUNC("calloc", guest_calloc),
 	WRAP_FUNC("close", close),
 	WRAP_FUNC("closedir", closedir),
 	WRAP_FUNC("cos", __aarch64_cos),
@@ -159,7 +161,7 @@ dynarec_import dynarec_imports[] = {
 	WRAP_FUNC("fputc", fputc),
 	WRAP_FUNC("fputs", fputs),
 	WRAP_FUNC("fread", fread),
-	WRAP_FUNC("free", free),
+	WRAP_FUNC("free", guest_free),
 	WRAP_FUNC("fseek", fseek),
 	WRAP_FUNC("ftell", ftell),
 	WRAP_FUNC("fwrite", __aarch64_fwrite),
@@ -247,7 +249,7 @@ dynarec_import dynarec_imports[] = {
 	WRAP_FUNC("localtime", localtime),
 	WRAP_FUNC("log", __aarch64_log),
 	WRAP_FUNC("log10f", log10f),
-	WRAP_FUNC("malloc", malloc),
+	WRAP_FUNC("malloc", guest_malloc),
 	WRAP_FUNC("mbrtowc", mbrtowc),
 	WRAP_FUNC("memchr", memchr),
 	WRAP_FUNC("memcpy", memcpy),
@@ -259,28 +261,35 @@ dynarec_import dynarec_imports[] = {
 	WRAP_FUNC("pow", __aarch64_pow),
 	WRAP_FUNC("powf", powf),
 	WRAP_FUNC("printf", __aarch64_printf),
-	WRAP_FUNC("pthread_once", __aarch64_pthread_once),
-	WRAP_FUNC("pthread_create", __aarch64_pthread_create),
-	WRAP_FUNC("pthread_getspecific", ret0),
-	WRAP_FUNC("pthread_join", pthread_join),
-	WRAP_FUNC("pthread_key_create", ret0),
-	WRAP_FUNC("pthread_key_delete", ret0),
-	WRAP_FUNC("pthread_mutexattr_init", ret0),
-	WRAP_FUNC("pthread_mutexattr_settype", ret0),
+	WRAP_FUNC_NESTED("pthread_once", __aarch64_pthread_once),
+	WRAP_FUNC("pthread_attr_destroy", ret0),
+	WRAP_FUNC("pthread_attr_init", __aarch64_pthread_attr_init),
+	WRAP_FUNC("pthread_attr_setdetachstate", __aarch64_pthread_attr_setdetachstate),
+	WRAP_FUNC("pthread_attr_setstacksize", __aarch64_pthread_attr_setstacksize),
+	WRAP_FUNC_NESTED("pthread_create", __aarch64_pthread_create), // Runs the thread in place with Unicorn
+	WRAP_FUNC("pthread_detach", __aarch64_pthread_detach),
+	WRAP_FUNC("pthread_getspecific", __aarch64_pthread_getspecific),
+	WRAP_FUNC("pthread_join", __aarch64_pthread_join),
+	WRAP_FUNC("pthread_key_create", __aarch64_pthread_key_create),
+	WRAP_FUNC("pthread_key_delete", __aarch64_pthread_key_delete),
+	WRAP_FUNC("pthread_mutexattr_init", __aarch64_pthread_mutexattr_init),
+	WRAP_FUNC("pthread_mutexattr_settype", __aarch64_pthread_mutexattr_settype),
+	WRAP_FUNC("pthread_mutexattr_gettype", __aarch64_pthread_mutexattr_gettype),
 	WRAP_FUNC("pthread_mutexattr_destroy", ret0),
 	WRAP_FUNC("pthread_mutex_destroy", __aarch64_pthread_mutex_destroy),
 	WRAP_FUNC("pthread_mutex_init", __aarch64_pthread_mutex_init),
 	WRAP_FUNC("pthread_mutex_lock", __aarch64_pthread_mutex_lock),
+	WRAP_FUNC("pthread_mutex_trylock", __aarch64_pthread_mutex_trylock),
 	WRAP_FUNC("pthread_mutex_unlock", __aarch64_pthread_mutex_unlock),
-	WRAP_FUNC("pthread_self", pthread_self),
+	WRAP_FUNC("pthread_self", __aarch64_pthread_self),
 	WRAP_FUNC("pthread_setschedparam", ret0),
-	WRAP_FUNC("pthread_setspecific", ret0),
+	WRAP_FUNC("pthread_setspecific", __aarch64_pthread_setspecific),
 	WRAP_FUNC("putc", putc),
 	WRAP_FUNC("putwc", putwc),
 	WRAP_FUNC("qsort", __aarch64_qsort),
 	WRAP_FUNC("rand", __aarch64_rand),
 	WRAP_FUNC("readdir", readdir),
-	WRAP_FUNC("realloc", realloc),
+	WRAP_FUNC("realloc", guest_realloc),
 	WRAP_FUNC("remove", remove),
 	WRAP_FUNC("setjmp", ret0),
 	WRAP_FUNC("sin", __aarch64_sin),
@@ -336,7 +345,13 @@ dynarec_import dynarec_imports[] = {
 	WRAP_FUNC("wmemmove", wmemmove),
 	WRAP_FUNC("wmemset", wmemset),
 };
-size_t dynarec_imports_num = sizeof(dynarec_imports) / sizeof(*dynarec_imports);
+const size_t dynarec_imports_num = sizeof(dynarec_imports) / sizeof(*dynarec_imports);
+static constexpr auto imports_trampolines = gen_trampolines(dynarec_imports, 0);
+const std::array<uint32_t, 2> *dynarec_imports_trampolines = imports_trampolines.data();
+static constexpr auto imports_hash = gen_thunk_hash(dynarec_imports);
+const uint16_t *dynarec_imports_hash = imports_hash.data();
+const size_t dynarec_imports_hash_mask = imports_hash.size() - 1;
+const uint32_t dynarec_imports_signature = gen_thunk_table_hash(dynarec_imports);
 
 /*
  * All the game specific code that needs to be executed right after executable is loaded in mem must be put here
@@ -400,6 +415,7 @@ uint8_t NVEventEGLInit(void) {
 void NVEventEGLSwapBuffers(void) {
 	debugLog("Swapping backbuffer\n");
 	glfwSwapBuffers(glfw_window);
+	bench_frame_tick();
 }
 
 void NVEventEGLMakeCurrent(void) {
@@ -564,13 +580,13 @@ int ReadDataFromPrivateStorage(const char *file, void **data, int *size) {
 	int ret = 0;
 
 	if (sz > 0) {
-		void *buf = malloc(sz);
+		void *buf = guest_malloc(sz); // Released by the guest
 		if (buf && fread(buf, sz, 1, f)) {
 			ret = 1;
 			*size = sz;
 			*data = buf;
 		} else {
-			free(buf);
+			guest_free(buf);
 		}
 	}
 
@@ -601,234 +617,246 @@ int OS_ScreenGetWidth(void) {
 }
 
 void *OS_ThreadLaunch(int (* func)(void *), void *arg, int r2, char *name, int r4, int priority) {
-	// FIXME: Keeping this simple for now, we just execute the thread fully prior returning
+	// The game never releases thread handles, so the thread runs detached and a dummy handle is returned
 	static char buf[0x80];
-	uintptr_t argptr = (uintptr_t)arg;
-#ifdef USE_INTERPRETER
-	uc_reg_write(uc, UC_ARM64_REG_X0, &argptr);
-#else
-	so_dynarec->SetRegister(0, argptr);
-#endif
-	so_run_fiber(so_dynarec, (uintptr_t)func);
+	uintptr_t thread;
+	if (__aarch64_pthread_create(&thread, NULL, (void *(*)(void *))func, arg)) {
+		printf("Failed to launch thread %s\n", name ? name : "");
+		return NULL;
+	}
+	__aarch64_pthread_detach(thread);
 	return buf;
 }
 
-int exec_patch_hooks(void *dynarec_base_addr) {
-	mkdir("./savegames");
-
-	strcpy((char *)((uintptr_t)dynarec_base_addr + so_find_addr_rx("StorageRootBuffer")), ".");
-	*(int *)((uintptr_t)dynarec_base_addr + so_find_addr_rx("IsAndroidPaused")) = 0;
-	*(uint8_t *)((uintptr_t)dynarec_base_addr + so_find_addr_rx("UseRGBA8")) = 1; // Game defaults to RGB565 which is lower quality
-	
-	// Filling qsort native functions database
-	qsort_db.insert({(uintptr_t)((uintptr_t)dynarec_base_addr + so_find_addr_rx("_ZN7ZIPFile12EntryCompareEPKvS1_")), ZIPFile_EntryCompare});
-	qsort_db.insert({(uintptr_t)((uintptr_t)dynarec_base_addr + so_find_addr_rx("_Z15RASFileNameCompPKvS0_")), RASFileNameComp});
-	qsort_db.insert({(uintptr_t)((uintptr_t)dynarec_base_addr + so_find_addr_rx("_ZNK6P_Text11getPositionEv") + 4), FontCmp});
-	qsort_db.insert({(uintptr_t)((uintptr_t)dynarec_base_addr + so_find_addr_rx("_ZN27X_AnimationMessageContainer8destructEv") - 16), AnimationMessageContainerCmp});
-	qsort_db.insert({(uintptr_t)((uintptr_t)dynarec_base_addr + so_find_addr_rx("_Z19priorityCompHiToLowPKvS0_")), PriorityCompHiToLow});
-	qsort_db.insert({(uintptr_t)((uintptr_t)dynarec_base_addr + so_find_addr_rx("_Z19priorityCompLowToHiPKvS0_")), PriorityCompLowToHi});
-	qsort_db.insert({(uintptr_t)((uintptr_t)dynarec_base_addr + so_find_addr_rx("_Z4cmplPKvS0_")), cmpl});
-	qsort_db.insert({(uintptr_t)((uintptr_t)dynarec_base_addr + so_find_addr_rx("_Z4cmphPKvS0_")), cmph});
-
-	// Vars used in AND_SystemInitialize
-	deviceChip = (int *)((uintptr_t)dynarec_base_addr + so_find_addr_rx("deviceChip"));
-	deviceForm = (int *)((uintptr_t)dynarec_base_addr + so_find_addr_rx("deviceForm"));
-	definedDevice = (int *)((uintptr_t)dynarec_base_addr + so_find_addr_rx("definedDevice"));
-
+/*
+ * List of game functions to be replaced with native variants
+ */
+#define HOOK_FUNC(name, func) gen_wrapper<&func>(name)
+#define HOOK_FUNC_NESTED(name, func) gen_wrapper<&func>(name, true)
+constexpr dynarec_thunk dynarec_hooks[] = {
 	// Hooking OS_ThreadLaunch since game doesn't properly clear thread handles
-	HOOK_FUNC("_Z15OS_ThreadLaunchPFjPvES_jPKci16OSThreadPriority", OS_ThreadLaunch);
+	HOOK_FUNC_NESTED("_Z15OS_ThreadLaunchPFjPvES_jPKci16OSThreadPriority", OS_ThreadLaunch),
 
 	// This hook exists just as a guard to know if we're reaching some code we should patch instead
-	HOOK_FUNC("_Z24NVThreadGetCurrentJNIEnvv", NVThreadGetCurrentJNIEnv);
+	HOOK_FUNC("_Z24NVThreadGetCurrentJNIEnvv", NVThreadGetCurrentJNIEnv),
 	
 	// Hooking these two functions since they rely on JNI which we avoid reimplementing
-	HOOK_FUNC("_Z26ReadDataFromPrivateStoragePKcRPcRi", ReadDataFromPrivateStorage);
-	HOOK_FUNC("_Z25WriteDataToPrivateStoragePKcS0_i", WriteDataToPrivateStorage);
+	HOOK_FUNC("_Z26ReadDataFromPrivateStoragePKcRPcRi", ReadDataFromPrivateStorage),
+	HOOK_FUNC("_Z25WriteDataToPrivateStoragePKcS0_i", WriteDataToPrivateStorage),
 	
 	// Language override
-	HOOK_FUNC("_Z25GetAndroidCurrentLanguagev", GetAndroidCurrentLanguage);
-	HOOK_FUNC("_Z25SetAndroidCurrentLanguagei", SetAndroidCurrentLanguage);
+	HOOK_FUNC("_Z25GetAndroidCurrentLanguagev", GetAndroidCurrentLanguage),
+	HOOK_FUNC("_Z25SetAndroidCurrentLanguagei", SetAndroidCurrentLanguage),
 	
 	// Redirect gamepad code to our own implementation
-	HOOK_FUNC("_Z25WarGamepad_GetGamepadTypei", WarGamepad_GetGamepadType);
-	HOOK_FUNC("_Z28WarGamepad_GetGamepadButtonsi", WarGamepad_GetGamepadButtons);
-	HOOK_FUNC("_Z25WarGamepad_GetGamepadAxisii", WarGamepad_GetGamepadAxis);
+	HOOK_FUNC("_Z25WarGamepad_GetGamepadTypei", WarGamepad_GetGamepadType),
+	HOOK_FUNC("_Z28WarGamepad_GetGamepadButtonsi", WarGamepad_GetGamepadButtons),
+	HOOK_FUNC("_Z25WarGamepad_GetGamepadAxisii", WarGamepad_GetGamepadAxis),
 
-	HOOK_FUNC("__cxa_guard_acquire", __cxa_guard_acquire);
-	HOOK_FUNC("__cxa_guard_release", __cxa_guard_release);
-	HOOK_FUNC("__cxa_throw", __cxa_throw);
+	HOOK_FUNC("__cxa_guard_acquire", __cxa_guard_acquire),
+	HOOK_FUNC("__cxa_guard_release", __cxa_guard_release),
+	HOOK_FUNC("__cxa_throw", __cxa_throw),
 	
 	// Disable movies playback for now
-	HOOK_FUNC("_Z12OS_MoviePlayPKcbbf", ret0);
-	HOOK_FUNC("_Z13AND_StopMoviev", ret0);
-	HOOK_FUNC("_Z20AND_MovieIsSkippableb", ret0);
-	HOOK_FUNC("_Z18AND_MovieTextScalei", ret0);
-	HOOK_FUNC("_Z18AND_IsMoviePlayingv", ret0);
-	HOOK_FUNC("_Z20OS_MoviePlayinWindowPKciiiibbf", ret0);
+	HOOK_FUNC("_Z12OS_MoviePlayPKcbbf", ret0),
+	HOOK_FUNC("_Z13AND_StopMoviev", ret0),
+	HOOK_FUNC("_Z20AND_MovieIsSkippableb", ret0),
+	HOOK_FUNC("_Z18AND_MovieTextScalei", ret0),
+	HOOK_FUNC("_Z18AND_IsMoviePlayingv", ret0),
+	HOOK_FUNC("_Z20OS_MoviePlayinWindowPKciiiibbf", ret0),
 	
 	// We don't use the original apk but extracted files
-	HOOK_FUNC("_Z9NvAPKOpenPKc", ret0);
+	HOOK_FUNC("_Z9NvAPKOpenPKc", ret0),
 	
 	// Disabling some checks we don't need
-	HOOK_FUNC("_Z20OS_ServiceAppCommandPKcS0_", ret0);
-	HOOK_FUNC("_Z23OS_ServiceAppCommandIntPKci", ret0);
-	HOOK_FUNC("_Z25OS_ServiceIsWifiAvailablev", ret0);
-	HOOK_FUNC("_Z28OS_ServiceIsNetworkAvailablev", ret0);
-	HOOK_FUNC("_Z12AND_OpenLinkPKc", ret0);
+	HOOK_FUNC("_Z20OS_ServiceAppCommandPKcS0_", ret0),
+	HOOK_FUNC("_Z23OS_ServiceAppCommandIntPKci", ret0),
+	HOOK_FUNC("_Z25OS_ServiceIsWifiAvailablev", ret0),
+	HOOK_FUNC("_Z28OS_ServiceIsNetworkAvailablev", ret0),
+	HOOK_FUNC("_Z12AND_OpenLinkPKc", ret0),
 	
 	// Inject OpenGL context
-	HOOK_FUNC("_Z14NVEventEGLInitv", NVEventEGLInit);
-	HOOK_FUNC("_Z21NVEventEGLMakeCurrentv", NVEventEGLMakeCurrent);
-	HOOK_FUNC("_Z23NVEventEGLUnmakeCurrentv", NVEventEGLUnmakeCurrent);
-	HOOK_FUNC("_Z21NVEventEGLSwapBuffersv", NVEventEGLSwapBuffers);
+	HOOK_FUNC("_Z14NVEventEGLInitv", NVEventEGLInit),
+	HOOK_FUNC("_Z21NVEventEGLMakeCurrentv", NVEventEGLMakeCurrent),
+	HOOK_FUNC("_Z23NVEventEGLUnmakeCurrentv", NVEventEGLUnmakeCurrent),
+	HOOK_FUNC("_Z21NVEventEGLSwapBuffersv", NVEventEGLSwapBuffers),
 	
 	// Override screen size
-	HOOK_FUNC("_Z17OS_ScreenGetWidthv", OS_ScreenGetWidth);
-	HOOK_FUNC("_Z18OS_ScreenGetHeightv", OS_ScreenGetHeight);
+	HOOK_FUNC("_Z17OS_ScreenGetWidthv", OS_ScreenGetWidth),
+	HOOK_FUNC("_Z18OS_ScreenGetHeightv", OS_ScreenGetHeight),
 	
 	// Disable vibration
-	HOOK_FUNC("_Z12VibratePhonei", ret0);
-	HOOK_FUNC("_Z14Mobile_Vibratei", ret0);
+	HOOK_FUNC("_Z12VibratePhonei", ret0),
+	HOOK_FUNC("_Z14Mobile_Vibratei", ret0),
 	
-	HOOK_FUNC("_Z14AND_DeviceTypev", AND_DeviceType);
-	HOOK_FUNC("_Z16AND_DeviceLocalev", AND_DeviceLocale);
-	HOOK_FUNC("_Z20AND_SystemInitializev", AND_SystemInitialize);
-	HOOK_FUNC("_Z21AND_ScreenSetWakeLockb", ret0);
-	HOOK_FUNC("_Z22AND_FileGetArchiveName13OSFileArchive", OS_FileGetArchiveName);
+	HOOK_FUNC("_Z14AND_DeviceTypev", AND_DeviceType),
+	HOOK_FUNC("_Z16AND_DeviceLocalev", AND_DeviceLocale),
+	HOOK_FUNC("_Z20AND_SystemInitializev", AND_SystemInitialize),
+	HOOK_FUNC("_Z21AND_ScreenSetWakeLockb", ret0),
+	HOOK_FUNC("_Z22AND_FileGetArchiveName13OSFileArchive", OS_FileGetArchiveName),
 
 	// Redirect OpenAL to native version
-	HOOK_FUNC("InitializeCriticalSection", ret0);
-	HOOK_FUNC("alAuxiliaryEffectSlotf", alAuxiliaryEffectSlotf);
-	HOOK_FUNC("alAuxiliaryEffectSlotfv", alAuxiliaryEffectSlotfv);
-	HOOK_FUNC("alAuxiliaryEffectSloti", alAuxiliaryEffectSloti);
-	HOOK_FUNC("alAuxiliaryEffectSlotiv", alAuxiliaryEffectSlotiv);
-	HOOK_FUNC("alBuffer3f", alBuffer3f);
-	HOOK_FUNC("alBuffer3i", alBuffer3i);
-	HOOK_FUNC("alBufferData", alBufferData);
-	HOOK_FUNC("alBufferf", alBufferf);
-	HOOK_FUNC("alBufferfv", alBufferfv);
-	HOOK_FUNC("alBufferi", alBufferi);
-	HOOK_FUNC("alBufferiv", alBufferiv);
-	HOOK_FUNC("alDeleteAuxiliaryEffectSlots", alDeleteAuxiliaryEffectSlots);
-	HOOK_FUNC("alDeleteBuffers", alDeleteBuffers_hook);
-	HOOK_FUNC("alDeleteEffects", alDeleteEffects);
-	HOOK_FUNC("alDeleteFilters", alDeleteFilters);
-	HOOK_FUNC("alDeleteSources", alDeleteSources);
-	HOOK_FUNC("alDisable", alDisable);
-	HOOK_FUNC("alDistanceModel", alDistanceModel);
-	HOOK_FUNC("alDopplerFactor", alDopplerFactor);
-	HOOK_FUNC("alDopplerVelocity", alDopplerVelocity);
-	HOOK_FUNC("alEffectf", alEffectf);
-	HOOK_FUNC("alEffectfv", alEffectfv);
-	HOOK_FUNC("alEffecti", alEffecti);
-	HOOK_FUNC("alEffectiv", alEffectiv);
-	HOOK_FUNC("alEnable", alEnable);
-	HOOK_FUNC("alFilterf", alFilterf);
-	HOOK_FUNC("alFilterfv", alFilterfv);
-	HOOK_FUNC("alFilteri", alFilteri);
-	HOOK_FUNC("alFilteriv", alFilteriv);
-	HOOK_FUNC("alGenAuxiliaryEffectSlots", alGenAuxiliaryEffectSlots);
-	HOOK_FUNC("alGenBuffers", alGenBuffers);
-	HOOK_FUNC("alGenEffects", alGenEffects);
-	HOOK_FUNC("alGenFilters", alGenFilters);
-	HOOK_FUNC("alGenSources", alGenSources);
-	HOOK_FUNC("alGetAuxiliaryEffectSlotf", alGetAuxiliaryEffectSlotf);
-	HOOK_FUNC("alGetAuxiliaryEffectSlotfv", alGetAuxiliaryEffectSlotfv);
-	HOOK_FUNC("alGetAuxiliaryEffectSloti", alGetAuxiliaryEffectSloti);
-	HOOK_FUNC("alGetAuxiliaryEffectSlotiv", alGetAuxiliaryEffectSlotiv);
-	HOOK_FUNC("alGetBoolean", alGetBoolean);
-	HOOK_FUNC("alGetBooleanv", alGetBooleanv);
-	HOOK_FUNC("alGetBuffer3f", alGetBuffer3f);
-	HOOK_FUNC("alGetBuffer3i", alGetBuffer3i);
-	HOOK_FUNC("alGetBufferf", alGetBufferf);
-	HOOK_FUNC("alGetBufferfv", alGetBufferfv);
-	HOOK_FUNC("alGetBufferi", alGetBufferi);
-	HOOK_FUNC("alGetBufferiv", alGetBufferiv);
-	HOOK_FUNC("alGetDouble", alGetDouble);
-	HOOK_FUNC("alGetDoublev", alGetDoublev);
-	HOOK_FUNC("alGetEffectf", alGetEffectf);
-	HOOK_FUNC("alGetEffectfv", alGetEffectfv);
-	HOOK_FUNC("alGetEffecti", alGetEffecti);
-	HOOK_FUNC("alGetEffectiv", alGetEffectiv);
-	HOOK_FUNC("alGetEnumValue", alGetEnumValue);
-	HOOK_FUNC("alGetError", alGetError);
-	HOOK_FUNC("alGetFilterf", alGetFilterf);
-	HOOK_FUNC("alGetFilterfv", alGetFilterfv);
-	HOOK_FUNC("alGetFilteri", alGetFilteri);
-	HOOK_FUNC("alGetFilteriv", alGetFilteriv);
-	HOOK_FUNC("alGetFloat", alGetFloat);
-	HOOK_FUNC("alGetFloatv", alGetFloatv);
-	HOOK_FUNC("alGetInteger", alGetInteger);
-	HOOK_FUNC("alGetIntegerv", alGetIntegerv);
-	HOOK_FUNC("alGetListener3f", alGetListener3f);
-	HOOK_FUNC("alGetListener3i", alGetListener3i);
-	HOOK_FUNC("alGetListenerf", alGetListenerf);
-	HOOK_FUNC("alGetListenerfv", alGetListenerfv);
-	HOOK_FUNC("alGetListeneri", alGetListeneri);
-	HOOK_FUNC("alGetListeneriv", alGetListeneriv);
-	HOOK_FUNC("alGetProcAddress", alGetProcAddress);
-	HOOK_FUNC("alGetSource3f", alGetSource3f);
-	HOOK_FUNC("alGetSource3i", alGetSource3i);
-	HOOK_FUNC("alGetSourcef", alGetSourcef);
-	HOOK_FUNC("alGetSourcefv", alGetSourcefv);
-	HOOK_FUNC("alGetSourcei", alGetSourcei);
-	HOOK_FUNC("alGetSourceiv", alGetSourceiv);
-	HOOK_FUNC("alGetString", alGetString);
-	HOOK_FUNC("alIsAuxiliaryEffectSlot", alIsAuxiliaryEffectSlot);
-	HOOK_FUNC("alIsBuffer", alIsBuffer);
-	HOOK_FUNC("alIsEffect", alIsEffect);
-	HOOK_FUNC("alIsEnabled", alIsEnabled);
-	HOOK_FUNC("alIsExtensionPresent", alIsExtensionPresent);
-	HOOK_FUNC("alIsFilter", alIsFilter);
-	HOOK_FUNC("alIsSource", alIsSource);
-	HOOK_FUNC("alListener3f", alListener3f);
-	HOOK_FUNC("alListener3i", alListener3i);
-	HOOK_FUNC("alListenerf", alListenerf);
-	HOOK_FUNC("alListenerfv", alListenerfv);
-	HOOK_FUNC("alListeneri", alListeneri);
-	HOOK_FUNC("alListeneriv", alListeneriv);
-	HOOK_FUNC("alSource3f", alSource3f);
-	HOOK_FUNC("alSource3i", alSource3i);
-	HOOK_FUNC("alSourcePause", alSourcePause);
-	HOOK_FUNC("alSourcePausev", alSourcePausev);
-	HOOK_FUNC("alSourcePlay", alSourcePlay);
-	HOOK_FUNC("alSourcePlayv", alSourcePlayv);
-	HOOK_FUNC("alSourceQueueBuffers", alSourceQueueBuffers);
-	HOOK_FUNC("alSourceRewind", alSourceRewind);
-	HOOK_FUNC("alSourceRewindv", alSourceRewindv);
-	HOOK_FUNC("alSourceStop", alSourceStop_hook);
-	HOOK_FUNC("alSourceStopv", alSourceStopv);
-	HOOK_FUNC("alSourceUnqueueBuffers", alSourceUnqueueBuffers);
-	HOOK_FUNC("alSourcef", alSourcef);
-	HOOK_FUNC("alSourcefv", alSourcefv);
-	HOOK_FUNC("alSourcei", alSourcei);
-	HOOK_FUNC("alSourceiv", alSourceiv);
-	HOOK_FUNC("alSpeedOfSound", alSpeedOfSound);
-	HOOK_FUNC("alcCaptureCloseDevice", alcCaptureCloseDevice);
-	HOOK_FUNC("alcCaptureOpenDevice", alcCaptureOpenDevice);
-	HOOK_FUNC("alcCaptureSamples", alcCaptureSamples);
-	HOOK_FUNC("alcCaptureStart", alcCaptureStart);
-	HOOK_FUNC("alcCaptureStop", alcCaptureStop);
-	HOOK_FUNC("alcCloseDevice", alcCloseDevice);
-	HOOK_FUNC("alcCreateContext", alcCreateContext_hook);
-	HOOK_FUNC("alcDestroyContext", alcDestroyContext);
-	HOOK_FUNC("alcGetContextsDevice", alcGetContextsDevice);
-	HOOK_FUNC("alcGetCurrentContext", alcGetCurrentContext);
-	HOOK_FUNC("alcGetEnumValue", alcGetEnumValue);
-	HOOK_FUNC("alcGetError", alcGetError);
-	HOOK_FUNC("alcGetIntegerv", alcGetIntegerv);
-	HOOK_FUNC("alcGetProcAddress", alcGetProcAddress);
-	HOOK_FUNC("alcGetString", alcGetString);
-	HOOK_FUNC("alcGetThreadContext", alcGetThreadContext);
-	HOOK_FUNC("alcIsExtensionPresent", alcIsExtensionPresent);
-	HOOK_FUNC("alcMakeContextCurrent", alcMakeContextCurrent);
-	HOOK_FUNC("alcOpenDevice", alcOpenDevice);
-	HOOK_FUNC("alcProcessContext", alcProcessContext);
-	HOOK_FUNC("alcSetThreadContext", alcSetThreadContext);
-	HOOK_FUNC("alcSuspendContext", alcSuspendContext);
+	HOOK_FUNC("InitializeCriticalSection", ret0),
+	HOOK_FUNC("alAuxiliaryEffectSlotf", alAuxiliaryEffectSlotf),
+	HOOK_FUNC("alAuxiliaryEffectSlotfv", alAuxiliaryEffectSlotfv),
+	HOOK_FUNC("alAuxiliaryEffectSloti", alAuxiliaryEffectSloti),
+	HOOK_FUNC("alAuxiliaryEffectSlotiv", alAuxiliaryEffectSlotiv),
+	HOOK_FUNC("alBuffer3f", alBuffer3f),
+	HOOK_FUNC("alBuffer3i", alBuffer3i),
+	HOOK_FUNC("alBufferData", alBufferData),
+	HOOK_FUNC("alBufferf", alBufferf),
+	HOOK_FUNC("alBufferfv", alBufferfv),
+	HOOK_FUNC("alBufferi", alBufferi),
+	HOOK_FUNC("alBufferiv", alBufferiv),
+	HOOK_FUNC("alDeleteAuxiliaryEffectSlots", alDeleteAuxiliaryEffectSlots),
+	HOOK_FUNC("alDeleteBuffers", alDeleteBuffers_hook),
+	HOOK_FUNC("alDeleteEffects", alDeleteEffects),
+	HOOK_FUNC("alDeleteFilters", alDeleteFilters),
+	HOOK_FUNC("alDeleteSources", alDeleteSources),
+	HOOK_FUNC("alDisable", alDisable),
+	HOOK_FUNC("alDistanceModel", alDistanceModel),
+	HOOK_FUNC("alDopplerFactor", alDopplerFactor),
+	HOOK_FUNC("alDopplerVelocity", alDopplerVelocity),
+	HOOK_FUNC("alEffectf", alEffectf),
+	HOOK_FUNC("alEffectfv", alEffectfv),
+	HOOK_FUNC("alEffecti", alEffecti),
+	HOOK_FUNC("alEffectiv", alEffectiv),
+	HOOK_FUNC("alEnable", alEnable),
+	HOOK_FUNC("alFilterf", alFilterf),
+	HOOK_FUNC("alFilterfv", alFilterfv),
+	HOOK_FUNC("alFilteri", alFilteri),
+	HOOK_FUNC("alFilteriv", alFilteriv),
+	HOOK_FUNC("alGenAuxiliaryEffectSlots", alGenAuxiliaryEffectSlots),
+	HOOK_FUNC("alGenBuffers", alGenBuffers),
+	HOOK_FUNC("alGenEffects", alGenEffects),
+	HOOK_FUNC("alGenFilters", alGenFilters),
+	HOOK_FUNC("alGenSources", alGenSources),
+	HOOK_FUNC("alGetAuxiliaryEffectSlotf", alGetAuxiliaryEffectSlotf),
+	HOOK_FUNC("alGetAuxiliaryEffectSlotfv", alGetAuxiliaryEffectSlotfv),
+	HOOK_FUNC("alGetAuxiliaryEffectSloti", alGetAuxiliaryEffectSloti),
+	HOOK_FUNC("alGetAuxiliaryEffectSlotiv", alGetAuxiliaryEffectSlotiv),
+	HOOK_FUNC("alGetBoolean", alGetBoolean),
+	HOOK_FUNC("alGetBooleanv", alGetBooleanv),
+	HOOK_FUNC("alGetBuffer3f", alGetBuffer3f),
+	HOOK_FUNC("alGetBuffer3i", alGetBuffer3i),
+	HOOK_FUNC("alGetBufferf", alGetBufferf),
+	HOOK_FUNC("alGetBufferfv", alGetBufferfv),
+	HOOK_FUNC("alGetBufferi", alGetBufferi),
+	HOOK_FUNC("alGetBufferiv", alGetBufferiv),
+	HOOK_FUNC("alGetDouble", alGetDouble),
+	HOOK_FUNC("alGetDoublev", alGetDoublev),
+	HOOK_FUNC("alGetEffectf", alGetEffectf),
+	HOOK_FUNC("alGetEffectfv", alGetEffectfv),
+	HOOK_FUNC("alGetEffecti", alGetEffecti),
+	HOOK_FUNC("alGetEffectiv", alGetEffectiv),
+	HOOK_FUNC("alGetEnumValue", alGetEnumValue),
+	HOOK_FUNC("alGetError", alGetError),
+	HOOK_FUNC("alGetFilterf", alGetFilterf),
+	HOOK_FUNC("alGetFilterfv", alGetFilterfv),
+	HOOK_FUNC("alGetFilteri", alGetFilteri),
+	HOOK_FUNC("alGetFilteriv", alGetFilteriv),
+	HOOK_FUNC("alGetFloat", alGetFloat),
+	HOOK_FUNC("alGetFloatv", alGetFloatv),
+	HOOK_FUNC("alGetInteger", alGetInteger),
+	HOOK_FUNC("alGetIntegerv", alGetIntegerv),
+	HOOK_FUNC("alGetListener3f", alGetListener3f),
+	HOOK_FUNC("alGetListener3i", alGetListener3i),
+	HOOK_FUNC("alGetListenerf", alGetListenerf),
+	HOOK_FUNC("alGetListenerfv", alGetListenerfv),
+	HOOK_FUNC("alGetListeneri", alGetListeneri),
+	HOOK_FUNC("alGetListeneriv", alGetListeneriv),
+	HOOK_FUNC("alGetProcAddress", alGetProcAddress),
+	HOOK_FUNC("alGetSource3f", alGetSource3f),
+	HOOK_FUNC("alGetSource3i", alGetSource3i),
+	HOOK_FUNC("alGetSourcef", alGetSourcef),
+	HOOK_FUNC("alGetSourcefv", alGetSourcefv),
+	HOOK_FUNC("alGetSourcei", alGetSourcei),
+	HOOK_FUNC("alGetSourceiv", alGetSourceiv),
+	HOOK_FUNC("alGetString", alGetString),
+	HOOK_FUNC("alIsAuxiliaryEffectSlot", alIsAuxiliaryEffectSlot),
+	HOOK_FUNC("alIsBuffer", alIsBuffer),
+	HOOK_FUNC("alIsEffect", alIsEffect),
+	HOOK_FUNC("alIsEnabled", alIsEnabled),
+	HOOK_FUNC("alIsExtensionPresent", alIsExtensionPresent),
+	HOOK_FUNC("alIsFilter", alIsFilter),
+	HOOK_FUNC("alIsSource", alIsSource),
+	HOOK_FUNC("alListener3f", alListener3f),
+	HOOK_FUNC("alListener3i", alListener3i),
+	HOOK_FUNC("alListenerf", alListenerf),
+	HOOK_FUNC("alListenerfv", alListenerfv),
+	HOOK_FUNC("alListeneri", alListeneri),
+	HOOK_FUNC("alListeneriv", alListeneriv),
+	HOOK_FUNC("alSource3f", alSource3f),
+	HOOK_FUNC("alSource3i", alSource3i),
+	HOOK_FUNC("alSourcePause", alSourcePause),
+	HOOK_FUNC("alSourcePausev", alSourcePausev),
+	HOOK_FUNC("alSourcePlay", alSourcePlay),
+	HOOK_FUNC("alSourcePlayv", alSourcePlayv),
+	HOOK_FUNC("alSourceQueueBuffers", alSourceQueueBuffers),
+	HOOK_FUNC("alSourceRewind", alSourceRewind),
+	HOOK_FUNC("alSourceRewindv", alSourceRewindv),
+	HOOK_FUNC("alSourceStop", alSourceStop_hook),
+	HOOK_FUNC("alSourceStopv", alSourceStopv),
+	HOOK_FUNC("alSourceUnqueueBuffers", alSourceUnqueueBuffers),
+	HOOK_FUNC("alSourcef", alSourcef),
+	HOOK_FUNC("alSourcefv", alSourcefv),
+	HOOK_FUNC("alSourcei", alSourcei),
+	HOOK_FUNC("alSourceiv", alSourceiv),
+	HOOK_FUNC("alSpeedOfSound", alSpeedOfSound),
+	HOOK_FUNC("alcCaptureCloseDevice", alcCaptureCloseDevice),
+	HOOK_FUNC("alcCaptureOpenDevice", alcCaptureOpenDevice),
+	HOOK_FUNC("alcCaptureSamples", alcCaptureSamples),
+	HOOK_FUNC("alcCaptureStart", alcCaptureStart),
+	HOOK_FUNC("alcCaptureStop", alcCaptureStop),
+	HOOK_FUNC("alcCloseDevice", alcCloseDevice),
+	HOOK_FUNC("alcCreateContext", alcCreateContext_hook),
+	HOOK_FUNC("alcDestroyContext", alcDestroyContext),
+	HOOK_FUNC("alcGetContextsDevice", alcGetContextsDevice),
+	HOOK_FUNC("alcGetCurrentContext", alcGetCurrentContext),
+	HOOK_FUNC("alcGetEnumValue", alcGetEnumValue),
+	HOOK_FUNC("alcGetError", alcGetError),
+	HOOK_FUNC("alcGetIntegerv", alcGetIntegerv),
+	HOOK_FUNC("alcGetProcAddress", alcGetProcAddress),
+	HOOK_FUNC("alcGetString", alcGetString),
+	HOOK_FUNC("alcGetThreadContext", alcGetThreadContext),
+	HOOK_FUNC("alcIsExtensionPresent", alcIsExtensionPresent),
+	HOOK_FUNC("alcMakeContextCurrent", alcMakeContextCurrent),
+	HOOK_FUNC("alcOpenDevice", alcOpenDevice),
+	HOOK_FUNC("alcProcessContext", alcProcessContext),
+	HOOK_FUNC("alcSetThreadContext", alcSetThreadContext),
+	HOOK_FUNC("alcSuspendContext", alcSuspendContext),
 
 	// Events processing
-	HOOK_FUNC("_Z13ProcessEventsb", ProcessEvents);
+	HOOK_FUNC("_Z13ProcessEventsb", ProcessEvents),
+};
+const size_t dynarec_hooks_num = sizeof(dynarec_hooks) / sizeof(*dynarec_hooks);
+
+int exec_patch_hooks(void *dynarec_base_addr) {
+	mkdir("./savegames");
+
+	strcpy((char *)((uintptr_t)dynarec_base_addr + so_find_addr_rx("StorageRootBuffer")), ".");
+	*(int *)((uintptr_t)dynarec_base_addr + so_find_addr_rx("IsAndroidPaused")) = 0;
+	*(uint8_t *)((uintptr_t)dynarec_base_addr + so_find_addr_rx("UseRGBA8")) = 1; // Game defaults to RGB565 which is lower quality
+	
+	// Filling qsort native functions database
+	qsort_db.insert({(uintptr_t)((uintptr_t)dynarec_base_addr + so_find_addr_rx("_ZN7ZIPFile12EntryCompareEPKvS1_")), ZIPFile_EntryCompare});
+	qsort_db.insert({(uintptr_t)((uintptr_t)dynarec_base_addr + so_find_addr_rx("_Z15RASFileNameCompPKvS0_")), RASFileNameComp});
+	qsort_db.insert({(uintptr_t)((uintptr_t)dynarec_base_addr + so_find_addr_rx("_ZNK6P_Text11getPositionEv") + 4), FontCmp});
+	qsort_db.insert({(uintptr_t)((uintptr_t)dynarec_base_addr + so_find_addr_rx("_ZN27X_AnimationMessageContainer8destructEv") - 16), AnimationMessageContainerCmp});
+	qsort_db.insert({(uintptr_t)((uintptr_t)dynarec_base_addr + so_find_addr_rx("_Z19priorityCompHiToLowPKvS0_")), PriorityCompHiToLow});
+	qsort_db.insert({(uintptr_t)((uintptr_t)dynarec_base_addr + so_find_addr_rx("_Z19priorityCompLowToHiPKvS0_")), PriorityCompLowToHi});
+	qsort_db.insert({(uintptr_t)((uintptr_t)dynarec_base_addr + so_find_addr_rx("_Z4cmplPKvS0_")), cmpl});
+	qsort_db.insert({(uintptr_t)((uintptr_t)dynarec_base_addr + so_find_addr_rx("_Z4cmphPKvS0_")), cmph});
+
+	// Vars used in AND_SystemInitialize
+	deviceChip = (int *)((uintptr_t)dynarec_base_addr + so_find_addr_rx("deviceChip"));
+	deviceForm = (int *)((uintptr_t)dynarec_base_addr + so_find_addr_rx("deviceForm"));
+	definedDevice = (int *)((uintptr_t)dynarec_base_addr + so_find_addr_rx("definedDevice"));
+
+	// Redirecting hooked functions to their native variants
+	for (size_t i = 0; i < dynarec_hooks_num; i++)
+		hook_arm64((uintptr_t)dynarec_base_addr + so_find_addr_rx(dynarec_hooks[i].symbol.data()), DYNAREC_THUNK_HOOK | i);
+
 
 	return 0;
 }
@@ -14,8 +14,6 @@
 
 /* Functions */
 extern GLFWwindow *glfw_window;
-extern dynarec_import dynarec_imports[];
-extern size_t dynarec_imports_num;
 
 extern int exec_booting_sequence(void *dynarec_base_addr);
 extern int exec_patch_hooks(void *dynarec_base_addr);
@@ -3,78 +3,544 @@
  * with the guest application. In order to fix this, we abstract the pthread object accesses and making the implementation agnostic to struct sizes.
  */
 
+#include <errno.h>
+#include <limits.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "dynarec.h"
 #include "so_util.h"
 #include "aarch64_pthread.h"
+#ifdef USE_INTERPRETER
+#include "interpreter.h"
+#endif
+
+#ifdef __MINGW64__
+#include <synchapi.h> // WaitOnAddress, needs -lsynchronization
+#else
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Sleeps while *addr holds val, wakes up waiters on addr. Used by guest mutexes and pthread_once.
+static void aarch64_futex_wait(std::atomic<uint32_t> *addr, uint32_t val) {
+#ifdef __MINGW64__
+	WaitOnAddress(addr, &val, sizeof(val), INFINITE);
+#else
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#endif
+}
+
+static void aarch64_futex_wake(std::atomic<uint32_t> *addr, bool all = false) {
+#ifdef __MINGW64__
+	if (all)
+		WakeByAddressAll(addr);
+	else
+		WakeByAddressSingle(addr);
+#else
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1, NULL, NULL, 0);
+#endif
+}
+
+// Bionic pthread_once_t is a 32 bit word starting out as PTHREAD_ONCE_INIT (0)
+#define AARCH64_ONCE_INIT (0)
+#define AARCH64_ONCE_RUNNING (1)
+#define AARCH64_ONCE_DONE (2)
 
-int __aarch64_pthread_once(pthread_once_t *__once_control, void (*__init_routine) (void)) {
-	if (*__once_control == PTHREAD_ONCE_INIT) {
+int __aarch64_pthread_once(uint32_t *__once_control, void (*__init_routine) (void)) {
+	std::atomic<uint32_t> *state = (std::atomic<uint32_t> *)__once_control;
+	uint32_t expected = AARCH64_ONCE_INIT;
+	if (state->compare_exchange_strong(expected, AARCH64_ONCE_RUNNING, std::memory_order_acquire)) {
 		so_run_fiber(so_dynarec, (uintptr_t)__init_routine);
-		*__once_control = !PTHREAD_ONCE_INIT;
+		state->store(AARCH64_ONCE_DONE, std::memory_order_release);
+		aarch64_futex_wake(state, true);
+		return 0;
 	}
 
+	// Someone else runs the routine, it has to be done before anybody carries on
+	while ((expected = state->load(std::memory_order_acquire)) != AARCH64_ONCE_DONE)
+		aarch64_futex_wait(state, expected);
 	return 0;
 }
 
-int __aarch64_pthread_create(Dynarmic::A64::Jit *jit, pthread_t *__restrict __newthread, const pthread_attr_t *__restrict __attr, void *(*__start_routine) (void *), void *__restrict __arg) {
-	printf("NOIMPL: pthread_create called\n");
-	std::abort();
+/*
+ * Guest threads: every thread runs on a host thread of its own with its own Jit, stack and TLS
+ * block. Jits share the guest image, so_monitor (told apart by processor id) and code
+ * invalidations (see so_jit_register). pthread_t values handed to the guest are aarch64_thread
+ * pointers, the main thread included.
+ *
+ * Building a Jit is expensive and a fresh one has nothing translated, so finished threads give
+ * theirs back to a pool together with the TLS block. Reset only clears the guest state, the code
+ * cache survives and the next thread starts with the blocks already compiled.
+ */
+typedef struct {
+	Dynarmic::A64::Jit *jit;
+	uint64_t tpidr; // TPIDR_EL0 of the thread running on it, the Jit reads it through its config
+	int processor_id;
+} aarch64_cpu;
+
+typedef struct {
+	std::thread host;
+	aarch64_cpu *cpu;
+	uint8_t *stack;
+	size_t stack_size;
+	uintptr_t entry;
+	uintptr_t arg;
+	uintptr_t ret;
+	bool detached;
+	bool finished;
+} aarch64_thread;
+
+static aarch64_thread main_thread;
+static thread_local aarch64_thread *current_thread = &main_thread;
+static std::mutex threads_mutex;
+static bool processor_used[DYNAREC_MAX_PROCESSORS] = {true}; // Processor 0 is the main thread
+
+/*
+ * pthread keys: values live in the TLS block of every thread (see so_tls_keys), so getspecific is a
+ * single load from the calling thread slots. Keys only get handed out under keys_mutex, which also
+ * clears the slot in every live block so a recycled key never shows the value of a deleted one.
+ */
+#define AARCH64_PTHREAD_DESTRUCTOR_ITERATIONS (4)
+
+static std::mutex keys_mutex;
+static bool key_used[DYNAREC_TLS_KEYS];
+static void (*key_destructors[DYNAREC_TLS_KEYS])(void *);
+static std::vector<uintptr_t> tls_blocks_alive; // TPIDR_EL0 of every TLS block but the main thread one
+static thread_local uintptr_t *current_keys = nullptr;
+
+static inline uintptr_t *aarch64_key_slots(void) {
+	if (!current_keys) // Main thread
+		current_keys = so_tls_keys(tpidr_el0_reg);
+	return current_keys;
+}
+
+int __aarch64_pthread_key_create(int *__key, void (*__destructor)(void *)) {
+	std::lock_guard<std::mutex> lock(keys_mutex);
+	for (int i = 0; i < DYNAREC_TLS_KEYS; i++) {
+		if (key_used[i])
+			continue;
+		key_used[i] = true;
+		key_destructors[i] = __destructor;
+		so_tls_keys(tpidr_el0_reg)[i] = 0;
+		for (uintptr_t tp : tls_blocks_alive)
+			so_tls_keys(tp)[i] = 0;
+		*__key = i;
+		return 0;
+	}
+	return EAGAIN;
+}
+
+int __aarch64_pthread_key_delete(int __key) {
+	std::lock_guard<std::mutex> lock(keys_mutex);
+	if (__key < 0 || __key >= DYNAREC_TLS_KEYS || !key_used[__key])
+		return EINVAL;
+	key_used[__key] = false;
+	key_destructors[__key] = NULL;
 	return 0;
 }
 
-int __aarch64_pthread_mutex_init(pthread_mutex_t** uid, const int* mutexattr) {
-	pthread_mutex_t *m = (pthread_mutex_t *)calloc(1, sizeof(pthread_mutex_t));
-	if (!m)
-		return -1;
+void *__aarch64_pthread_getspecific(int __key) {
+	if ((unsigned)__key >= DYNAREC_TLS_KEYS)
+		return NULL;
+	return (void *)aarch64_key_slots()[__key];
+}
 
-	const int recursive = (mutexattr && *mutexattr == 1);
-	*m = recursive ? PTHREAD_RECURSIVE_MUTEX_INITIALIZER : PTHREAD_MUTEX_INITIALIZER;
+int __aarch64_pthread_setspecific(int __key, const void *__value) {
+	if ((unsigned)__key >= DYNAREC_TLS_KEYS)
+		return EINVAL;
+	aarch64_key_slots()[__key] = (uintptr_t)__value;
+	return 0;
+}
 
-	int ret = pthread_mutex_init(m, NULL);
-	if (ret < 0) {
-		free(m);
-		return -1;
+#ifndef USE_INTERPRETER
+// Runs the destructors of the non-NULL values the exiting thread holds, as many rounds as POSIX asks for
+static void aarch64_key_destructors(Dynarmic::A64::Jit *jit) {
+	uintptr_t *slots = aarch64_key_slots();
+	for (int round = 0; round < AARCH64_PTHREAD_DESTRUCTOR_ITERATIONS; round++) {
+		bool called = false;
+		for (int i = 0; i < DYNAREC_TLS_KEYS; i++) {
+			void (*destructor)(void *);
+			{
+				std::lock_guard<std::mutex> lock(keys_mutex);
+				destructor = key_used[i] ? key_destructors[i] : NULL;
+			}
+			uintptr_t value = slots[i];
+			if (!destructor || !value)
+				continue;
+			slots[i] = 0;
+			jit->SetRegister(0, value);
+			so_run_fiber(jit, (uintptr_t)destructor);
+			called = true;
+		}
+		if (!called)
+			break;
 	}
+}
+#endif
 
-	*uid = m;
+#ifndef USE_INTERPRETER
+static std::vector<aarch64_cpu *> cpu_pool;
+static uint64_t cpu_pool_hits = 0;
+static uint64_t cpu_pool_misses = 0;
 
-	return 0;
+static aarch64_cpu *aarch64_cpu_create(void) {
+	aarch64_cpu *cpu = new aarch64_cpu();
+	{
+		std::lock_guard<std::mutex> lock(threads_mutex);
+		for (int i = 1; i < DYNAREC_MAX_PROCESSORS; i++) {
+			if (!processor_used[i]) {
+				processor_used[i] = true;
+				cpu->processor_id = i;
+				break;
+			}
+		}
+	}
+	if (!cpu->processor_id) {
+		printf("Failed to create guest thread, all %d processors are in use\n", DYNAREC_MAX_PROCESSORS);
+		delete cpu;
+		return NULL;
+	}
+	cpu->tpidr = so_tls_alloc();
+	if (!cpu->tpidr) {
+		std::lock_guard<std::mutex> lock(threads_mutex);
+		processor_used[cpu->processor_id] = false;
+		delete cpu;
+		return NULL;
+	}
+	{
+		std::lock_guard<std::mutex> lock(keys_mutex);
+		tls_blocks_alive.push_back(cpu->tpidr);
+	}
+
+	Dynarmic::A64::UserConfig cfg = so_dynarec_cfg;
+	cfg.processor_id = cpu->processor_id;
+	cfg.tpidrro_el0 = &cpu->tpidr;
+	cfg.tpidr_el0 = &cpu->tpidr;
+	cpu->jit = new Dynarmic::A64::Jit(cfg);
+	so_jit_register(cpu->jit, cpu->processor_id);
+	return cpu;
 }
 
-int __aarch64_pthread_mutex_destroy(pthread_mutex_t** uid) {
-	if (uid && *uid && (uintptr_t)*uid > 0x8000) {
-		pthread_mutex_destroy(*uid);
-		free(*uid);
-		*uid = NULL;
+static void aarch64_cpu_destroy(aarch64_cpu *cpu) {
+	so_jit_unregister(cpu->processor_id);
+	delete cpu->jit;
+	{
+		std::lock_guard<std::mutex> lock(keys_mutex);
+		tls_blocks_alive.erase(std::find(tls_blocks_alive.begin(), tls_blocks_alive.end(), cpu->tpidr));
 	}
-	return 0;
+	so_tls_free(cpu->tpidr);
+	std::lock_guard<std::mutex> lock(threads_mutex);
+	processor_used[cpu->processor_id] = false;
+	delete cpu;
+}
+
+static aarch64_cpu *aarch64_cpu_acquire(void) {
+	{
+		std::lock_guard<std::mutex> lock(threads_mutex);
+		if (!cpu_pool.empty()) {
+			aarch64_cpu *cpu = cpu_pool.back();
+			cpu_pool.pop_back();
+			cpu_pool_hits++;
+			return cpu;
+		}
+		cpu_pool_misses++;
+	}
+	return aarch64_cpu_create();
+}
+
+static void aarch64_cpu_release(aarch64_cpu *cpu) {
+	cpu->jit->Reset();
+	so_tls_reset(cpu->tpidr);
+	{
+		std::lock_guard<std::mutex> lock(threads_mutex);
+		if (cpu_pool.size() < DYNAREC_JIT_POOL_MAX) {
+			cpu_pool.push_back(cpu);
+			return;
+		}
+	}
+	aarch64_cpu_destroy(cpu);
+}
+#endif
+
+// Builds Jit instances up front so that the first threads don't pay for it either
+void aarch64_thread_pool_init(int count) {
+#ifndef USE_INTERPRETER
+	for (int i = 0; i < count; i++) {
+		aarch64_cpu *cpu = aarch64_cpu_create();
+		if (!cpu)
+			break;
+		std::lock_guard<std::mutex> lock(threads_mutex);
+		cpu_pool.push_back(cpu);
+	}
+	debugLog("%llu Jit instances ready for guest threads\n", cpu_pool.size());
+#endif
+}
+
+void aarch64_thread_pool_print_stats(void) {
+#ifndef USE_INTERPRETER
+	std::lock_guard<std::mutex> lock(threads_mutex);
+	uint64_t total = cpu_pool_hits + cpu_pool_misses;
+	printf("Jit pool: %llu idle, %llu hits, %llu misses (%.1f%% hit rate)\n", cpu_pool.size(), cpu_pool_hits,
+		cpu_pool_misses, total ? 100.0 * cpu_pool_hits / total : 0.0);
+#endif
 }
 
-int __aarch64_pthread_mutex_lock(pthread_mutex_t** uid) {
-	int ret = 0;
-	if (!*uid) {
-		ret = __aarch64_pthread_mutex_init(uid, NULL);
+static void aarch64_thread_destroy(aarch64_thread *t) {
+#ifndef USE_INTERPRETER
+	if (t->cpu)
+		aarch64_cpu_release(t->cpu);
+	if (t->stack)
+		guest_stack_free(t->stack);
+#endif
+	delete t;
+}
+
+#ifndef USE_INTERPRETER
+static void aarch64_thread_main(aarch64_thread *t) {
+	Dynarmic::A64::Jit *jit = t->cpu->jit;
+	current_thread = t;
+	current_keys = so_tls_keys(t->cpu->tpidr);
+	so_dynarec = jit;
+	jit->SetSP(((uintptr_t)t->stack + t->stack_size) & ~0xFULL); // attr sizes need not keep SP 16 byte aligned
+	jit->SetRegister(0, t->arg);
+	so_run_fiber(jit, t->entry);
+	t->ret = jit->GetRegister(0);
+	aarch64_key_destructors(jit);
+	so_dynarec = nullptr;
+
+	bool detached;
+	{
+		std::lock_guard<std::mutex> lock(threads_mutex);
+		t->finished = true;
+		detached = t->detached;
 	}
-	else if ((uintptr_t)*uid == 0x4000) {
-		int attr = 1; // recursive
-		ret = __aarch64_pthread_mutex_init(uid, &attr);
+	if (detached)
+		aarch64_thread_destroy(t);
+}
+#endif
+
+int __aarch64_pthread_create(uintptr_t *__newthread, const aarch64_pthread_attr_t *__attr, void *(*__start_routine) (void *), void *__arg) {
+	aarch64_thread *t = new aarch64_thread();
+	t->entry = (uintptr_t)__start_routine;
+	t->arg = (uintptr_t)__arg;
+	*__newthread = (uintptr_t)t;
+
+#ifdef USE_INTERPRETER
+	// A single Unicorn instance holds the guest state, so the thread runs to completion right away
+	uc_reg_write(uc, UC_ARM64_REG_X0, &t->arg);
+	so_run_fiber(so_dynarec, t->entry);
+	uc_reg_read(uc, UC_ARM64_REG_X0, &t->ret);
+	t->finished = true;
+#else
+	t->stack_size = __attr && __attr->stack_size ? __attr->stack_size : DYNAREC_STACK_SIZE;
+	t->stack = guest_stack_alloc(t->stack_size);
+	t->cpu = t->stack ? aarch64_cpu_acquire() : NULL;
+	if (!t->cpu) {
+		aarch64_thread_destroy(t);
+		*__newthread = 0;
+		return EAGAIN;
+	}
+	t->host = std::thread(aarch64_thread_main, t);
+#endif
+	if (__attr && (__attr->flags & AARCH64_PTHREAD_ATTR_FLAG_DETACHED))
+		__aarch64_pthread_detach((uintptr_t)t);
+	return 0;
+}
+
+int __aarch64_pthread_detach(uintptr_t __th) {
+	aarch64_thread *t = (aarch64_thread *)__th;
+	if (t == &main_thread)
+		return EINVAL;
+
+	bool finished;
+	{
+		// The host thread may delete t as soon as it sees detached, so it has to be let go first
+		std::lock_guard<std::mutex> lock(threads_mutex);
+		if (t->detached)
+			return EINVAL;
+		if (t->host.joinable())
+			t->host.detach();
+		t->detached = true;
+		finished = t->finished;
 	}
-	if (ret < 0) {
-		return ret;
+	// Otherwise the thread cleans up after itself
+	if (finished)
+		aarch64_thread_destroy(t);
+	return 0;
+}
+
+int __aarch64_pthread_join(uintptr_t __th, void **__retval) {
+	aarch64_thread *t = (aarch64_thread *)__th;
+	if (t == current_thread)
+		return EDEADLK;
+	if (t == &main_thread)
+		return EINVAL;
+	{
+		std::lock_guard<std::mutex> lock(threads_mutex);
+		if (t->detached)
+			return EINVAL;
 	}
-	return pthread_mutex_lock(*uid);
+
+	if (t->host.joinable())
+		t->host.join();
+	if (__retval)
+		*__retval = (void *)t->ret;
+	aarch64_thread_destroy(t);
+	return 0;
+}
+
+uintptr_t __aarch64_pthread_self(void) {
+	return (uintptr_t)current_thread;
+}
+
+int __aarch64_pthread_attr_init(aarch64_pthread_attr_t *__attr) {
+	memset(__attr, 0, sizeof(*__attr));
+	__attr->stack_size = DYNAREC_STACK_SIZE;
+	__attr->guard_size = GUEST_STACK_GUARD_SIZE;
+	return 0;
+}
+
+int __aarch64_pthread_attr_setdetachstate(aarch64_pthread_attr_t *__attr, int __state) {
+	if (__state == AARCH64_PTHREAD_CREATE_DETACHED)
+		__attr->flags |= AARCH64_PTHREAD_ATTR_FLAG_DETACHED;
+	else if (__state == AARCH64_PTHREAD_CREATE_JOINABLE)
+		__attr->flags &= ~AARCH64_PTHREAD_ATTR_FLAG_DETACHED;
+	else
+		return EINVAL;
+	return 0;
+}
+
+int __aarch64_pthread_attr_setstacksize(aarch64_pthread_attr_t *__attr, size_t __size) {
+	if (__size < AARCH64_PTHREAD_STACK_MIN)
+		return EINVAL;
+	__attr->stack_size = __size;
+	return 0;
+}
+
+/*
+ * Guest mutexes live in place in the Bionic pthread_mutex_t, no host object is involved: word 0 holds
+ * the Bionic type bits (so static initializers work as is) and the lock state, word 1 the owner of
+ * recursive / error checking mutexes and word 2 the recursion depth. Locking is a single CAS when
+ * uncontended, waiters sleep on word 0 (futex on Linux, WaitOnAddress on Windows).
+ */
+#define AARCH64_MUTEX_TYPE_MASK (0xC000)
+#define AARCH64_MUTEX_RECURSIVE (0x4000)
+#define AARCH64_MUTEX_ERRORCHECK (0x8000)
+#define AARCH64_MUTEX_UNLOCKED (0)
+#define AARCH64_MUTEX_LOCKED (1)
+#define AARCH64_MUTEX_CONTENDED (2) // Locked with possible waiters
+#define AARCH64_MUTEX_STATE_MASK (0x3)
+
+struct aarch64_mutex {
+	std::atomic<uint32_t> state;
+	std::atomic<uint32_t> owner;
+	uint32_t depth;
+};
+
+static std::atomic<uint32_t> next_thread_id = 1;
+static thread_local uint32_t self_thread_id = 0;
+
+static inline uint32_t aarch64_self_id(void) {
+	if (!self_thread_id)
+		self_thread_id = next_thread_id++;
+	return self_thread_id;
+}
+
+static int aarch64_mutex_acquire(aarch64_mutex *m, bool try_only) {
+	const uint32_t type = m->state.load(std::memory_order_relaxed) & AARCH64_MUTEX_TYPE_MASK;
+	uint32_t expected = type | AARCH64_MUTEX_UNLOCKED;
+	if (m->state.compare_exchange_strong(expected, type | AARCH64_MUTEX_LOCKED, std::memory_order_acquire))
+		return 0;
+	if (try_only)
+		return EBUSY;
+
+	// Mark it contended so the owner wakes us up, then sleep until it gets released
+	while ((m->state.exchange(type | AARCH64_MUTEX_CONTENDED, std::memory_order_acquire) & AARCH64_MUTEX_STATE_MASK) != AARCH64_MUTEX_UNLOCKED)
+		aarch64_futex_wait(&m->state, type | AARCH64_MUTEX_CONTENDED);
+	return 0;
 }
 
-int __aarch64_pthread_mutex_unlock(pthread_mutex_t** uid) {
-	int ret = 0;
-	if (!*uid) {
-		ret = __aarch64_pthread_mutex_init(uid, NULL);
+static int aarch64_mutex_lock(aarch64_mutex *m, bool try_only) {
+	const uint32_t type = m->state.load(std::memory_order_relaxed) & AARCH64_MUTEX_TYPE_MASK;
+	if (type) {
+		const uint32_t self = aarch64_self_id();
+		if (m->owner.load(std::memory_order_relaxed) == self) {
+			if (type == AARCH64_MUTEX_ERRORCHECK)
+				return try_only ? EBUSY : EDEADLK;
+			if (m->depth == UINT32_MAX)
+				return EAGAIN;
+			m->depth++;
+			return 0;
+		}
+		int ret = aarch64_mutex_acquire(m, try_only);
+		if (ret)
+			return ret;
+		m->owner.store(self, std::memory_order_relaxed);
+		m->depth = 0;
+		return 0;
 	}
-	else if ((uintptr_t)*uid == 0x4000) {
-		int attr = 1; // recursive
-		ret = __aarch64_pthread_mutex_init(uid, &attr);
+	return aarch64_mutex_acquire(m, try_only);
+}
+
+int __aarch64_pthread_mutexattr_init(int64_t *__attr) {
+	*__attr = AARCH64_PTHREAD_MUTEX_NORMAL;
+	return 0;
+}
+
+int __aarch64_pthread_mutexattr_settype(int64_t *__attr, int __type) {
+	if (__type < AARCH64_PTHREAD_MUTEX_NORMAL || __type > AARCH64_PTHREAD_MUTEX_ERRORCHECK)
+		return EINVAL;
+	*__attr = (*__attr & ~0xFLL) | __type;
+	return 0;
+}
+
+int __aarch64_pthread_mutexattr_gettype(const int64_t *__attr, int *__type) {
+	*__type = *__attr & 0xF;
+	return 0;
+}
+
+int __aarch64_pthread_mutex_init(aarch64_mutex *__mutex, const int64_t *__attr) {
+	static const uint32_t types[] = {0, AARCH64_MUTEX_RECURSIVE, AARCH64_MUTEX_ERRORCHECK};
+	int type = __attr ? (*__attr & 0xF) : AARCH64_PTHREAD_MUTEX_NORMAL;
+	if (type > AARCH64_PTHREAD_MUTEX_ERRORCHECK)
+		return EINVAL;
+	__mutex->state.store(types[type], std::memory_order_relaxed);
+	__mutex->owner.store(0, std::memory_order_relaxed);
+	__mutex->depth = 0;
+	return 0;
+}
+
+int __aarch64_pthread_mutex_destroy(aarch64_mutex *__mutex) {
+	if (__mutex->state.load(std::memory_order_relaxed) & AARCH64_MUTEX_STATE_MASK)
+		return EBUSY;
+	return 0;
+}
+
+int __aarch64_pthread_mutex_lock(aarch64_mutex *__mutex) {
+	return aarch64_mutex_lock(__mutex, false);
+}
+
+int __aarch64_pthread_mutex_trylock(aarch64_mutex *__mutex) {
+	return aarch64_mutex_lock(__mutex, true);
+}
+
+int __aarch64_pthread_mutex_unlock(aarch64_mutex *__mutex) {
+	const uint32_t type = __mutex->state.load(std::memory_order_relaxed) & AARCH64_MUTEX_TYPE_MASK;
+	if (type) {
+		if (__mutex->owner.load(std::memory_order_relaxed) != aarch64_self_id())
+			return EPERM;
+		if (__mutex->depth) {
+			__mutex->depth--;
+			return 0;
+		}
+		__mutex->owner.store(0, std::memory_order_relaxed);
 	}
-	if (ret < 0)
-		return ret;
-	return pthread_mutex_unlock(*uid);
-}
\ No newline at end of file
+	if ((__mutex->state.exchange(type | AARCH64_MUTEX_UNLOCKED, std::memory_order_release) & AARCH64_MUTEX_STATE_MASK) == AARCH64_MUTEX_CONTENDED)
+		aarch64_futex_wake(&__mutex->state);
+	return 0;
+}
@@ -11,23 +11,36 @@
 #include <stdio.h>
 #include <string.h>
 #include <map>
+#include <unordered_map>
 #include <bits/stdc++.h>
+#include <sys/stat.h>
+#ifndef __MINGW64__
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include "elf.h"
 #include "dynarec.h"
 #include "so_util.h"
+#include "thunk_gen.h"
 
 #ifdef USE_INTERPRETER
 #include "interpreter.h"
 uc_engine *uc;
-std::vector<uc_hook> hooks;
-#define HOOKS_BASE_ADDRESS ((uintptr_t)load_base + load_size)
+#define HOOKS_BASE_ADDRESS (hooks_base)
 #define HOOKS_BLOCK_SIZE (65536)
+// Import trampolines fill the block from its start. Fixed slots sit right below the last page,
+// which holds the _ctype_ table and ends with the unresolved import stub.
+#define HOOKS_TLSDESC_OFFSET (HOOKS_BLOCK_SIZE - 0x1000 - 32) // 2 instructions, see tlsdesc_static_resolver
+#define HOOKS_STDERR_OFFSET (HOOKS_BLOCK_SIZE - 0x1000 - 24)
+#define HOOKS_STACK_CHK_FAIL_OFFSET (HOOKS_BLOCK_SIZE - 0x1000 - 16)
+#define HOOKS_STACK_CHK_GUARD_OFFSET (HOOKS_BLOCK_SIZE - 0x1000 - 8)
+#define HOOKS_CTYPE_OFFSET (HOOKS_BLOCK_SIZE - 0x1000)
+#define HOOKS_UNRESOLVED_OFFSET (HOOKS_BLOCK_SIZE - 4)
+#define HOOKS_TRAMPOLINES_SIZE (HOOKS_TLSDESC_OFFSET) // Room left for import trampolines
 #endif
 
-std::vector<uintptr_t> native_funcs;
-std::vector<std::string> native_funcs_names;
-
 extern uintptr_t __stack_chk_fail;
 static uint64_t __stack_chk_guard_fake = 0x4242424242424242;
 FILE *stderr_fake = (FILE*)0xDEADBEEFDEADBEEF;
@@ -77,11 +90,26 @@ static const char __BIONIC_ctype_[257] = {0,
 };
 
 so_env so_dynarec_env;
-Dynarmic::A64::Jit *so_dynarec = nullptr;
+so_pt_env so_dynarec_pt_env;
+int so_mem_mode = DYNAREC_MEM_CALLBACKS;
+size_t so_code_cache_size = DYNAREC_CODE_CACHE_SIZE;
+thread_local Dynarmic::A64::Jit *so_dynarec = nullptr;
 Dynarmic::ExclusiveMonitor *so_monitor = nullptr;
 Dynarmic::A64::UserConfig so_dynarec_cfg;
 uint8_t *so_stack;
 uint8_t *tpidr_el0;
+uint64_t tpidr_el0_reg; // Value of the guest TPIDR_EL0 register, Dynarmic reads it through a pointer
+
+const char *so_mem_mode_name(void) {
+	switch (so_mem_mode) {
+	case DYNAREC_MEM_FASTMEM:
+		return "fastmem";
+	case DYNAREC_MEM_PAGETABLE:
+		return "pagetable";
+	default:
+		return "callbacks";
+	}
+}
 
 void *text_base;
 void *aligned_text_base;
@@ -91,396 +119,1120 @@ void *data_base;
 void *aligned_data_base;
 size_t data_size;
 
-static void *load_base;
-static size_t load_size;
+// A loaded ELF image. Addresses in the ELF are relative to base, where vaddr 0 would land.
+struct so_module {
+	std::string path;
+	std::string name; // DT_SONAME, or the file name when there's none
+	uintptr_t base;
+	void *load_base; // Block holding every PT_LOAD segment
+	size_t load_size;
+	bool restored; // Relocated image came from the cache, see so_cache_load
+
+	Elf64_Ehdr ehdr;
+	uint64_t file_size;
+	uint32_t hdr_hash; // Covers ELF, program and section headers
+	uint64_t content_hash; // Covers the file content of every PT_LOAD segment
+	Elf64_Phdr *prog_hdr;
+	Elf64_Shdr *sec_hdr;
+	Elf64_Sym *syms;
+	int num_syms;
+	char *shstrtab;
+	char *dynstrtab;
+	size_t dynstr_size;
+	std::vector<const char *> needed; // DT_NEEDED entries
+
+	// Relocation tables, all taken from PT_DYNAMIC (see so_read_dynamic)
+	std::vector<std::span<Elf64_Rela>> rela_tables; // DT_RELA, DT_JMPREL and unpacked DT_ANDROID_RELA
+	std::vector<Elf64_Rela> packed_relas;
+	std::span<const uint64_t> relr; // DT_RELR or DT_ANDROID_RELR
+
+	// PT_TLS template, copied in every thread TLS block at tls_offset from TPIDR_EL0
+	uintptr_t tls_image;
+	size_t tls_filesz, tls_memsz;
+	size_t tls_offset;
+
+	// Symbol lookup tables, taken from the ELF itself when available (see so_build_symbol_index)
+	uint32_t *gnu_hash_tbl;
+	uint32_t *sysv_hash_tbl;
+	std::unordered_map<std::string_view, Elf64_Sym *> sym_by_name; // Fallback when the ELF has no hash table
+	std::unordered_map<std::string_view, uintptr_t> got_by_name;
+	std::unordered_map<uintptr_t, const char *> got_names;
+	std::vector<Elf64_Sym *> sym_by_addr; // Defined symbols sorted by address
+};
 
-static void *so_base;
+// Main ELF first, then its dependencies in breadth first DT_NEEDED order. Undefined
+// symbols are looked up in the same order.
+static std::vector<so_module *> so_modules;
 
-static Elf64_Ehdr *elf_hdr;
-static Elf64_Phdr *prog_hdr;
-static Elf64_Shdr *sec_hdr;
-static Elf64_Sym *syms;
-static int num_syms;
+// Static TLS layout shared by all threads, see so_tls_alloc
+static size_t so_tls_size = (DYNAREC_TLS_SLOT_MAX + 1) * 8;
+static size_t so_tls_align = 16;
 
-static char *shstrtab;
-static char *dynstrtab;
+// Every TLS offset is known at load time, so TLSDESC descriptors all point at a resolver that
+// just returns the offset stored in their second word (ldr x0, [x0, #8]; ret)
+static const uint32_t tlsdesc_static_resolver[2] = {0xF9400400, DYNAREC_RET};
+
+#ifdef USE_INTERPRETER
+static uintptr_t hooks_base;
+#define TLSDESC_RESOLVER (HOOKS_BASE_ADDRESS + HOOKS_TLSDESC_OFFSET)
+#else
+#define TLSDESC_RESOLVER ((uintptr_t)tlsdesc_static_resolver)
+#endif
 
 void end_program_token() { }
 void unresolved_stub_token() { }
+void lazy_bind_token() { }
+
+bool so_lazy_binding = false;
+std::atomic<int> so_lazy_slots = 0;
+std::atomic<int> so_lazy_bound = 0;
+
+const dynarec_thunk *so_find_thunk(uint32_t id) {
+	const dynarec_thunk *thunks = (id & DYNAREC_THUNK_HOOK) ? dynarec_hooks : dynarec_imports;
+	return &thunks[id & DYNAREC_THUNK_INDEX_MASK];
+}
+
+// Id of the nested thunk that halted the Jit running on this thread
+static thread_local uint32_t so_pending_thunk;
 
 #ifdef USE_INTERPRETER
-static void hook_import(uc_engine *uc, uint64_t address, uint32_t size, void *user_data) {
-	address -= HOOKS_BASE_ADDRESS;
-	//debugLog(">>> Import called %llx (%s)\n", address / 4, native_funcs_names[address / 4].c_str());
-	uc_emu_stop(uc);
-	auto host_next = (void (*)(void *))(native_funcs[address / 4]);
-	host_next((void*)so_dynarec);
-}
-
-static void hook_patch(uc_engine *uc, uint64_t mem_address, uint32_t size, void *user_data) {
-	//debugLog("hook_patch %llx\n", mem_address);
-	uint32_t address = *(uint32_t *)mem_address / 4;
-	//debugLog(">>> Hooked function called %llx (%s)\n", address, native_funcs_names[address].c_str());
-	uc_emu_stop(uc);
-	auto host_next = (void (*)(void *))(native_funcs[address]);
-	host_next((void*)so_dynarec);
+static uc_hook svc_hook;
+static thread_local bool so_thunk_pending = false;
+
+/*
+ * Both backends share the SVC trampolines, so every import and hooked function goes through this
+ * single interrupt hook instead of a code hook per address, which would have Unicorn instrument
+ * the translated blocks. Thunks write the return address to PC themselves and emulation carries
+ * on from there; only nested thunks stop it, see so_run_fiber.
+ */
+static void hook_svc(uc_engine *uc, uint32_t intno, void *user_data) {
+	uint64_t pc;
+	uc_reg_read(uc, UC_ARM64_REG_PC, &pc);
+	uint32_t insn = *(uint32_t *)(pc - 4); // PC is past the SVC once the exception is taken
+	if (intno != 2 || (insn & 0xFFE0001F) != DYNAREC_SVC(0)) {
+		printf("Unexpected interrupt %u on PC: %llx\n", intno, pc - 4 - (uintptr_t)dynarec_base_addr);
+		uc_emu_stop(uc);
+		return;
+	}
+
+	uint32_t swi = (insn >> 5) & 0xFFFF;
+	if (swi & DYNAREC_SVC_THUNK) {
+		if (swi & DYNAREC_SVC_THUNK_NESTED) {
+			so_pending_thunk = swi & DYNAREC_SVC_THUNK_MASK;
+			so_thunk_pending = true;
+			uc_emu_stop(uc);
+		} else {
+			so_find_thunk(swi & DYNAREC_SVC_THUNK_MASK)->bridge(so_dynarec);
+		}
+		return;
+	}
+
+	switch (swi) {
+	case DYNAREC_SVC_UNRESOLVED:
+		{
+			uint64_t ra;
+			uc_reg_read(uc, REG_FP, &ra);
+			printf("Unresolved symbol called from %llx\n", ra - (uintptr_t)dynarec_base_addr);
+			abort();
+		}
+		break;
+	default:
+		printf("Unknown SVC %d\n", swi);
+		uc_emu_stop(uc);
+		break;
+	}
 }
 #endif
 
-void hook_arm64(uintptr_t addr, dynarec_hook *dst) {
-#ifdef USE_INTERPRETER
-	//debugLog("hook_arm64 %llx, %s\n", addr, native_funcs_names[(uint32_t)dst->trampoline / 4].c_str());
-	auto hook = hooks.emplace_back();
-	*(uint32_t *)addr = dst->trampoline;
-	uc_hook_add(uc, &hook, UC_HOOK_CODE, (void *)hook_patch, NULL, addr, addr);
-#else
+void hook_arm64(uintptr_t addr, uint32_t id) {
 	if (addr == 0)
 		return;
-	memcpy((void *)addr, (void *)dst->trampoline, sizeof(uint32_t) * 2);
+	std::array<uint32_t, 2> trampoline = gen_trampoline(id, so_find_thunk(id)->nested);
+	so_patch_text(addr, trampoline.data(), sizeof(trampoline));
+}
+
+/*
+ * W^X: once the image is ready, executable segments are left read-only. Guest code has to be
+ * changed with so_patch_text, which only invalidates the blocks covering what it touched. Any
+ * other write to text traps in so_fault_handler, which makes the page writable again and has
+ * it invalidated before the guest goes on (see so_flush_dirty_text).
+ */
+#define SO_DIRTY_PAGES_MAX (64)
+#define SO_TEXT_RANGES_MAX (256)
+
+static size_t host_page_size;
+static std::atomic<bool> text_protected = false;
+// Read-only, page aligned. Fault handlers read them on any thread, so entries are only ever
+// appended (under text_patch_mutex) and published through text_ranges_num.
+static struct {
+	uintptr_t start, end;
+} text_ranges[SO_TEXT_RANGES_MAX];
+static std::atomic<int> text_ranges_num = 0;
+static std::mutex text_patch_mutex;
+static std::atomic<uintptr_t> dirty_pages[SO_DIRTY_PAGES_MAX];
+static std::atomic<bool> dirty_text = false;
+static std::atomic<bool> dirty_pages_overflow = false;
+std::atomic<uint64_t> so_text_invalidations = 0;
+
+// Every Jit alive by processor id, guest code changes have to reach all of them. Fault handlers
+// only read the slots, everything else goes through so_jits_mutex.
+static std::atomic<Dynarmic::A64::Jit *> so_jits[DYNAREC_MAX_PROCESSORS];
+static std::mutex so_jits_mutex;
+
+void so_jit_register(Dynarmic::A64::Jit *jit, int processor_id) {
+	std::lock_guard<std::mutex> lock(so_jits_mutex);
+	so_jits[processor_id] = jit;
+}
+
+// Has to be called before the Jit gets deleted
+void so_jit_unregister(int processor_id) {
+	std::lock_guard<std::mutex> lock(so_jits_mutex);
+	so_jits[processor_id] = nullptr;
+}
+
+#ifndef USE_INTERPRETER
+static void so_jits_invalidate(uintptr_t addr, size_t size) {
+	std::lock_guard<std::mutex> lock(so_jits_mutex);
+	for (auto &slot : so_jits) {
+		Dynarmic::A64::Jit *jit = slot.load();
+		if (jit)
+			jit->InvalidateCacheRange(addr, size);
+	}
+}
 #endif
+
+static size_t so_host_page_size(void) {
+#ifdef __MINGW64__
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#else
+	return sysconf(_SC_PAGESIZE);
+#endif
+}
+
+static bool so_set_writable(uintptr_t start, size_t size, bool writable) {
+#ifdef __MINGW64__
+	DWORD old;
+	return VirtualProtect((void *)start, size, writable ? PAGE_READWRITE : PAGE_READONLY, &old);
+#else
+	return mprotect((void *)start, size, writable ? PROT_READ | PROT_WRITE : PROT_READ) == 0;
+#endif
+}
+
+static bool so_in_text(uintptr_t addr) {
+	int num = text_ranges_num.load(std::memory_order_acquire);
+	for (int i = 0; i < num; i++) {
+		if (addr >= text_ranges[i].start && addr < text_ranges[i].end)
+			return true;
+	}
+	return false;
 }
 
+// Runs in signal / exception handler context, only touches atomics and page protections
+static bool so_text_fault(uintptr_t addr) {
+	if (!text_protected || !so_in_text(addr))
+		return false;
+	uintptr_t page = addr & ~(host_page_size - 1);
+	if (!so_set_writable(page, host_page_size, true))
+		return false;
+
+	int i = 0;
+	for (; i < SO_DIRTY_PAGES_MAX; i++) {
+		uintptr_t expected = 0;
+		if (dirty_pages[i].compare_exchange_strong(expected, page))
+			break;
+	}
+	if (i == SO_DIRTY_PAGES_MAX)
+		dirty_pages_overflow = true;
+	dirty_text = true;
+	for (auto &slot : so_jits) {
+		Dynarmic::A64::Jit *jit = slot.load();
+		if (jit)
+			jit->HaltExecution(Dynarmic::HaltReason::CacheInvalidation);
+	}
+	return true;
+}
+
+#ifdef __MINGW64__
+static LONG CALLBACK so_fault_handler(EXCEPTION_POINTERS *info) {
+	EXCEPTION_RECORD *rec = info->ExceptionRecord;
+	if (rec->ExceptionCode != EXCEPTION_ACCESS_VIOLATION)
+		return EXCEPTION_CONTINUE_SEARCH;
+	if (rec->ExceptionInformation[0] == 1 && so_text_fault(rec->ExceptionInformation[1]))
+		return EXCEPTION_CONTINUE_EXECUTION;
+	if (guest_stack_fault(rec->ExceptionInformation[1]))
+		return EXCEPTION_CONTINUE_EXECUTION;
+	return EXCEPTION_CONTINUE_SEARCH;
+}
+#else
+static struct sigaction prev_segv_action;
+
+static void so_fault_handler(int sig, siginfo_t *info, void *ctx) {
+	if (so_text_fault((uintptr_t)info->si_addr) || guest_stack_fault((uintptr_t)info->si_addr))
+		return;
+
+	// Not ours, hand it to whoever was there before (eg. Dynarmic fastmem)
+	if (prev_segv_action.sa_flags & SA_SIGINFO)
+		prev_segv_action.sa_sigaction(sig, info, ctx);
+	else if (prev_segv_action.sa_handler == SIG_DFL)
+		signal(sig, SIG_DFL); // The access faults again and terminates as usual
+	else if (prev_segv_action.sa_handler != SIG_IGN)
+		prev_segv_action.sa_handler(sig);
+}
+#endif
+
+// Catches writes to protected text and guest stack faults, installed before any guest code runs
+void so_install_fault_handler(void) {
+	static bool installed = false;
+	if (installed)
+		return;
+	installed = true;
+#ifdef __MINGW64__
+	AddVectoredExceptionHandler(1, so_fault_handler);
+#else
+	struct sigaction action = {};
+	action.sa_sigaction = so_fault_handler;
+	action.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGSEGV, &action, &prev_segv_action);
+#endif
+}
+
+// Leaves the pages fully inside [addr, addr + size) read-only, see so_text_fault
+bool so_protect_text_range(uintptr_t addr, size_t size) {
+#ifndef USE_INTERPRETER
+	if (!host_page_size)
+		host_page_size = so_host_page_size();
+	uintptr_t start = ALIGN_MEM(addr, host_page_size);
+	uintptr_t end = (addr + size) & ~(host_page_size - 1);
+	if (start >= end)
+		return false;
+
+	// Published before the pages turn read-only, so that no write can fault on an unknown range
+	std::lock_guard<std::mutex> lock(text_patch_mutex);
+	int num = text_ranges_num.load(std::memory_order_relaxed);
+	if (num == SO_TEXT_RANGES_MAX) {
+		printf("Too many text ranges to write protect\n");
+		return false;
+	}
+	text_ranges[num].start = start;
+	text_ranges[num].end = end;
+	text_ranges_num.store(num + 1, std::memory_order_release);
+	if (!so_set_writable(start, end - start, false)) {
+		text_ranges_num.store(num, std::memory_order_release);
+		return false;
+	}
+	text_protected = true;
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Leaves the executable segments of every module read-only
+void so_protect_text(void) {
+#ifndef USE_INTERPRETER
+	host_page_size = so_host_page_size();
+	for (so_module *m : so_modules) {
+		for (int i = 0; i < m->ehdr.e_phnum; i++) {
+			Elf64_Phdr *phdr = &m->prog_hdr[i];
+			if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X))
+				continue;
+			// Pages shared with a writable segment stay writable
+			so_protect_text_range(m->base + phdr->p_vaddr, phdr->p_memsz);
+		}
+	}
+	text_protected = true;
+	debugLog("%d text ranges write protected\n", text_ranges_num.load());
+#endif
+}
+
+// Writes guest code, the JIT only drops the blocks covering the patched range
+void so_patch_text(uintptr_t addr, const void *data, size_t size) {
+	std::lock_guard<std::mutex> lock(text_patch_mutex);
+	uintptr_t start = text_protected ? addr & ~(host_page_size - 1) : 0;
+	uintptr_t end = text_protected ? ALIGN_MEM(addr + size, host_page_size) : 0;
+	bool reprotect = start < end && so_in_text(start);
+	if (reprotect)
+		so_set_writable(start, end - start, true);
+	memcpy((void *)addr, data, size);
+	if (reprotect)
+		so_set_writable(start, end - start, false);
+#ifndef USE_INTERPRETER
+	so_jits_invalidate(addr, size);
+#endif
+}
+
+#ifndef USE_INTERPRETER
+// Drops the code compiled from text pages written without so_patch_text, on every Jit. The pages
+// are made read-only again first, so that the next write traps and invalidates once more.
+static void so_flush_dirty_text(void) {
+	if (!dirty_text.exchange(false))
+		return;
+	std::lock_guard<std::mutex> lock(text_patch_mutex);
+	if (dirty_pages_overflow.exchange(false)) {
+		for (auto &page : dirty_pages)
+			page = 0;
+		for (int i = 0; i < text_ranges_num.load(std::memory_order_relaxed); i++)
+			so_set_writable(text_ranges[i].start, text_ranges[i].end - text_ranges[i].start, false);
+		std::lock_guard<std::mutex> jits_lock(so_jits_mutex);
+		for (auto &slot : so_jits) {
+			Dynarmic::A64::Jit *jit = slot.load();
+			if (jit)
+				jit->ClearCache();
+		}
+		so_text_invalidations++;
+		return;
+	}
+	for (auto &page : dirty_pages) {
+		uintptr_t addr = page.exchange(0);
+		if (addr) {
+			so_set_writable(addr, host_page_size, false);
+			so_jits_invalidate(addr, host_page_size);
+			so_text_invalidations++;
+		}
+	}
+}
+#endif
+
 void so_flush_caches(void) {
 #ifndef USE_INTERPRETER
-	so_dynarec->InvalidateCacheRange((uintptr_t)load_base, load_size);
+	for (so_module *m : so_modules)
+		so_jits_invalidate((uintptr_t)m->load_base, m->load_size);
 #endif
 }
 
+// Releases the headers read by so_load, no so_* helper can be used after this
 void so_free_temp(void) {
-	free(so_base);
-	so_base = NULL;
+	for (so_module *m : so_modules) {
+		free(m->prog_hdr);
+		free(m->sec_hdr);
+		free(m->shstrtab);
+		m->prog_hdr = NULL;
+		m->sec_hdr = NULL;
+		m->shstrtab = NULL;
+	}
 }
 
 #ifdef USE_INTERPRETER
 // Hooks to deal with dynamically allocated memory mapping
+#define SO_UC_FAULT_CHUNK (0x100000ULL) // Faulting accesses map the whole 1 MB aligned chunk around them
+
 uc_hook mem_invalid_hook;
 
-struct mem_span {
-	uint64_t start;
-	uint64_t end;
-	mem_span *next;
-	mem_span *prev;
-};
+// Ranges mapped into Unicorn (start -> end), disjoint and coalesced. Guest addresses are host
+// addresses, so growing a span only needs the new pages mapped next to it.
+static std::map<uint64_t, uint64_t> uc_spans;
+static std::mutex uc_spans_mutex;
 
-mem_span *span_list = nullptr;
-static int span_count = 0;
+static bool so_uc_map_range(uint64_t start, uint64_t end) {
+	if (const auto err = uc_mem_map_ptr(uc, start, end - start, UC_PROT_ALL, (void *)start)) {
+		printf("Failed to map unmapped memory at %p: %u (%s)\n", (void *)start, err, uc_strerror(err));
+		return false;
+	}
+	return true;
+}
 
-bool unmappedMemoryHook(uc_engine* uc, uc_mem_type type, u64 start_address, int size, u64 value, void* user_data) {
-	const auto do_map = [&](const uint64_t start, const uint64_t end) {
-		if (const auto err = uc_mem_map_ptr(uc, start, end - start, UC_PROT_ALL, (void *)start)) {
-			printf("Failed to map unmapped memory at %p: %u (%s)\n", (void*)start, err, uc_strerror(err));
-			abort();
-			return false;
+static bool so_uc_map_locked(uint64_t start, uint64_t end) {
+	// Find the first span that may overlap or touch [start, end)
+	auto first = uc_spans.upper_bound(start);
+	if (first != uc_spans.begin() && std::prev(first)->second >= start)
+		--first;
+
+	// Map the gaps between existing spans. Everything below cur is mapped in Unicorn by then.
+	uint64_t new_start = start, cur = start;
+	bool res = true;
+	auto it = first;
+	for (; it != uc_spans.end() && it->first <= end; ++it) {
+		if (it->first > cur && !so_uc_map_range(cur, it->first)) {
+			res = false;
+			break;
 		}
-		return true;
-	};
+		cur = std::max(cur, it->second);
+		new_start = std::min(new_start, it->first);
+	}
+	if (res && cur < end) {
+		if (so_uc_map_range(cur, end))
+			cur = end;
+		else
+			res = false;
+	}
 
-	const auto do_unmap = [&](const uint64_t start, const uint64_t end) {
-		if (const auto err = uc_mem_unmap(uc, start, end - start)) {
-			printf("Failed to unmap mapped memory at %p: %u (%s)\n", (void*)start, err, uc_strerror(err));
-			abort();
-			return false;
+	// Fold the spans walked over and the gaps mapped between them, a failed gap stays out
+	uc_spans.erase(first, it);
+	if (new_start < cur)
+		uc_spans[new_start] = cur;
+	return res;
+}
+
+// Maps host memory at the same guest address, skipping whatever is already mapped
+bool so_uc_map(uintptr_t start, size_t size) {
+	std::lock_guard<std::mutex> lock(uc_spans_mutex);
+	return so_uc_map_locked(start & ~0xFFFULL, ALIGN_MEM(start + size, 0x1000));
+}
+
+void so_uc_unmap(uintptr_t start, size_t size) {
+	uint64_t end = ALIGN_MEM(start + size, 0x1000);
+	start &= ~0xFFFULL;
+	std::lock_guard<std::mutex> lock(uc_spans_mutex);
+	if (const auto err = uc_mem_unmap(uc, start, end - start)) {
+		printf("Failed to unmap mapped memory at %p: %u (%s)\n", (void *)start, err, uc_strerror(err));
+		return;
+	}
+
+	// Trim or split the spans covering the range
+	auto it = uc_spans.upper_bound(start);
+	if (it != uc_spans.begin())
+		--it;
+	while (it != uc_spans.end() && it->first < end) {
+		uint64_t s_start = it->first, s_end = it->second;
+		if (s_end <= start) {
+			++it;
+			continue;
 		}
-		return true;
-	};
+		it = uc_spans.erase(it);
+		if (s_start < start)
+			uc_spans[s_start] = start;
+		if (s_end > end)
+			uc_spans[end] = s_end;
+	}
+}
 
-	uint64_t a_start = start_address & ~0xFFFULL;
-	uint64_t a_end = (start_address + size + 0xFFFULL) & ~0xFFFULL;
+bool unmappedMemoryHook(uc_engine* uc, uc_mem_type type, u64 start_address, int size, u64 value, void* user_data) {
+	if (start_address < 0x1000ULL)
+		return false;
 
+	uint64_t a_start = start_address & ~(SO_UC_FAULT_CHUNK - 1);
+	uint64_t a_end = ALIGN_MEM(start_address + size, SO_UC_FAULT_CHUNK);
 	if (a_start < 0x1000ULL)
-		return false;
+		a_start = 0x1000ULL;
 
-	if (span_list == nullptr) {
-		// list is empty; become head
-		span_list = new mem_span { a_start, a_end, nullptr, nullptr };
-		++span_count;
-		do_map(a_start, a_end);
-		return true;
+	std::lock_guard<std::mutex> lock(uc_spans_mutex);
+	if (!so_uc_map_locked(a_start, a_end)) {
+		// The rest of the chunk may not be mappable, fall back to the accessed pages
+		if (!so_uc_map_locked(start_address & ~0xFFFULL, ALIGN_MEM(start_address + size, 0x1000)))
+			abort();
 	}
+	return true;
+}
+#endif
 
-	if (a_start <= span_list->start) {
-		// we're at the beginning of the list; check if we can merge
-		if (a_end >= span_list->start) {
-			// yes; just expand the head node
-			do_unmap(span_list->start, span_list->end);
-			span_list->start = a_start;
-			span_list->end = std::max(a_end, span_list->end);
-			do_map(span_list->start, span_list->end);
-		} else {
-			// no; insert ourselves at the start
-			span_list = new mem_span { a_start, a_end, span_list, nullptr };
-			++span_count;
-			span_list->next->prev = span_list;
-			do_map(a_start, a_end);
+static uint32_t gnu_hash(const char *name) {
+	uint32_t h = 5381;
+	for (; *name; name++)
+		h = (h << 5) + h + (uint8_t)*name;
+	return h;
+}
+
+static uint32_t sysv_hash(const char *name) {
+	uint32_t h = 0, g;
+	for (; *name; name++) {
+		h = (h << 4) + (uint8_t)*name;
+		g = h & 0xF0000000;
+		if (g)
+			h ^= g >> 24;
+		h &= ~g;
+	}
+	return h;
+}
+
+static Elf64_Sym *so_lookup_sym(so_module *m, const char *name) {
+	if (m->gnu_hash_tbl) {
+		// nbuckets, symoffset, bloom_size, bloom_shift, bloom[bloom_size], buckets[nbuckets], chain[]
+		uint32_t nbuckets = m->gnu_hash_tbl[0];
+		uint32_t symoffset = m->gnu_hash_tbl[1];
+		uint32_t bloom_size = m->gnu_hash_tbl[2];
+		uint32_t bloom_shift = m->gnu_hash_tbl[3];
+		uint64_t *bloom = (uint64_t *)&m->gnu_hash_tbl[4];
+		uint32_t *buckets = (uint32_t *)&bloom[bloom_size];
+		uint32_t *chain = &buckets[nbuckets];
+
+		uint32_t h1 = gnu_hash(name);
+		uint64_t word = bloom[(h1 / 64) % bloom_size];
+		uint64_t mask = (1ULL << (h1 % 64)) | (1ULL << ((h1 >> bloom_shift) % 64));
+		if ((word & mask) != mask)
+			return NULL;
+
+		uint32_t idx = buckets[h1 % nbuckets];
+		if (idx < symoffset)
+			return NULL;
+		for (;; idx++) {
+			uint32_t h2 = chain[idx - symoffset];
+			if ((h1 | 1) == (h2 | 1) && strcmp(m->dynstrtab + m->syms[idx].st_name, name) == 0)
+				return &m->syms[idx];
+			if (h2 & 1)
+				return NULL;
 		}
-		return true;
+	} else if (m->sysv_hash_tbl) {
+		// nbucket, nchain, bucket[nbucket], chain[nchain]
+		uint32_t nbucket = m->sysv_hash_tbl[0];
+		uint32_t *bucket = &m->sysv_hash_tbl[2];
+		uint32_t *chain = &bucket[nbucket];
+		for (uint32_t idx = bucket[sysv_hash(name) % nbucket]; idx; idx = chain[idx]) {
+			if (strcmp(m->dynstrtab + m->syms[idx].st_name, name) == 0)
+				return &m->syms[idx];
+		}
+		return NULL;
 	}
 
-	// find where we fit in
-	mem_span *it = span_list;
-	while (it->next && it->next->start < a_start) {
-		it = it->next;
+	auto it = m->sym_by_name.find(name);
+	return it != m->sym_by_name.end() ? it->second : NULL;
+}
+
+// Calls fn on every RELA relocation of a module, packed ones included
+template <typename F>
+static void so_for_each_rela(so_module *m, F fn) {
+	for (auto &table : m->rela_tables) {
+		for (Elf64_Rela &rel : table)
+			fn(&rel);
 	}
+}
 
-	if (it->next == nullptr) {
-		// reached end of list; check if we can merge with the last node
-		if (it->end >= a_start) {
-			// yes; just expand it then
-			do_unmap(it->start, it->end);
-			do_map(it->start, a_end);
-			it->end = a_end;
+// Calls fn on every slot patched by a slice of a RELR table, which has to start on an
+// address entry. Address entries patch one slot and move past it, bitmap entries patch
+// the slots matching their bits among the next 63.
+template <typename F>
+static void so_for_each_relr(so_module *m, const uint64_t *entry, const uint64_t *end, F fn) {
+	uintptr_t *where = NULL;
+	for (; entry < end; entry++) {
+		if ((*entry & 1) == 0) {
+			where = (uintptr_t *)(m->base + *entry);
+			fn(where++);
 		} else {
-			// no; add ourselves to the end
-			it->next = new mem_span { a_start, a_end, nullptr, it };
-			++span_count;
-			do_map(a_start, a_end);
+			uint64_t bits = *entry >> 1;
+			for (int i = 0; bits; bits >>= 1, i++) {
+				if (bits & 1)
+					fn(where + i);
+			}
+			where += 63;
 		}
-		return true;
 	}
+}
 
-	// in the middle somewhere
-	if (it->end >= a_start && it->next->start <= a_end) {
-		// double merge; bridge the gap and remove the right node
-		do_unmap(it->start, it->end);
-		do_unmap(it->next->start, it->next->end);
-		it->end = it->next->end;
-		mem_span *new_next = it->next->next;
-		if (new_next)
-			new_next->prev = it;
-		delete it->next;
-		--span_count;
-		it->next = new_next;
-		do_map(it->start, it->end);
-	} else if (it->end >= a_start) {
-		// left merge; extend left node to include us
-		do_unmap(it->start, it->end);
-		do_map(it->start, a_end);
-		it->end = a_end;
-	} else if (it->next->start <= a_end) {
-		// right merge; extend right node to include us
-		do_unmap(it->next->start, it->next->end);
-		do_map(a_start, it->next->end);
-		it->next->start = a_start;
-	} else {
-		// no merge; insert ourselves in the middle
-		mem_span *new_node = new mem_span { a_start, a_end, it->next, it };
-		++span_count;
-		it->next->prev = new_node;
-		it->next = new_node;
-		do_map(a_start, a_end);
+// Builds the lookup tables used by the so_find_* helpers so that hooking and patching
+// don't have to walk .dynsym and the relocation tables for every single symbol
+static void so_build_symbol_index(so_module *m) {
+	for (int i = 0; i < m->ehdr.e_phnum; i++) {
+		if (m->prog_hdr[i].p_type == PT_DYNAMIC) {
+			Elf64_Dyn *dyn = (Elf64_Dyn *)(m->base + m->prog_hdr[i].p_vaddr);
+			for (; dyn->d_tag != DT_NULL; dyn++) {
+				if (dyn->d_tag == DT_GNU_HASH)
+					m->gnu_hash_tbl = (uint32_t *)(m->base + dyn->d_un.d_ptr);
+				else if (dyn->d_tag == DT_HASH)
+					m->sysv_hash_tbl = (uint32_t *)(m->base + dyn->d_un.d_ptr);
+			}
+		}
 	}
 
-	return true;
+	for (int i = 0; i < m->num_syms; i++) {
+		if (!m->gnu_hash_tbl && !m->sysv_hash_tbl)
+			m->sym_by_name.insert({m->dynstrtab + m->syms[i].st_name, &m->syms[i]});
+		if (m->syms[i].st_shndx != SHN_UNDEF && m->syms[i].st_value)
+			m->sym_by_addr.push_back(&m->syms[i]);
+	}
+	std::sort(m->sym_by_addr.begin(), m->sym_by_addr.end(), [](Elf64_Sym *a, Elf64_Sym *b) {
+		return a->st_value < b->st_value;
+	});
+
+	so_for_each_rela(m, [m](Elf64_Rela *rel) {
+		int type = ELF64_R_TYPE(rel->r_info);
+		if (type == R_AARCH64_GLOB_DAT || type == R_AARCH64_JUMP_SLOT) {
+			char *name = m->dynstrtab + m->syms[ELF64_R_SYM(rel->r_info)].st_name;
+			uintptr_t ptr = m->base + rel->r_offset;
+			m->got_by_name.insert({name, ptr});
+			m->got_names.insert({ptr, name});
+		}
+	});
+
+	debugLog("%s: symbol index of %d symbols (%s), %llu GOT slots\n", m->name.c_str(), m->num_syms,
+		m->gnu_hash_tbl ? "DT_GNU_HASH" : (m->sysv_hash_tbl ? "DT_HASH" : "built at load time"), m->got_names.size());
+}
+
+// FNV-1a
+static uint32_t so_hash(uint32_t h, const void *data, size_t size) {
+	for (size_t i = 0; i < size; i++)
+		h = (h ^ ((const uint8_t *)data)[i]) * 16777619u;
+	return h;
+}
+
+// FNV-1a over 64 bit words with a final mix per word, fast enough for whole images
+static uint64_t so_hash64(uint64_t h, const void *data, size_t size) {
+	const uint8_t *p = (const uint8_t *)data;
+	for (; size >= 8; p += 8, size -= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = (h ^ w) * 1099511628211ULL;
+		h ^= h >> 32;
+	}
+	for (; size; p++, size--)
+		h = (h ^ *p) * 1099511628211ULL;
+	return h;
 }
+
+static bool so_read(FILE *fd, void *dst, size_t size, uint64_t offset) {
+	return fseek(fd, offset, SEEK_SET) == 0 && fread(dst, 1, size, fd) == size;
+}
+
+// Places the file content of a PT_LOAD segment at dst. Memory coming from guest_mem_alloc is
+// zero filled already, so bss needs no work. On POSIX the file pages are mapped copy-on-write
+// straight from the page cache (faulted in lazily and shared until written), falling back to
+// a plain read when the segment can't be mapped on its own pages. With huge pages the segment
+// is always read, a file mapping would replace the huge pages backing the image.
+static int so_map_segment(FILE *fd, Elf64_Phdr *phdr, uintptr_t dst, uintptr_t prev_end) {
+	if (!phdr->p_filesz)
+		return 0;
+#ifndef __MINGW64__
+	const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+	const uintptr_t map_start = dst & ~(page_size - 1);
+	const uintptr_t delta = dst - map_start;
+	if (!guest_mem_huge_pages && (phdr->p_offset & (page_size - 1)) == delta && map_start >= ALIGN_MEM(prev_end, page_size)) {
+		const uintptr_t file_end = dst + phdr->p_filesz;
+		const size_t map_size = ALIGN_MEM(file_end - map_start, page_size);
+		void *res = mmap((void *)map_start, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno(fd), phdr->p_offset - delta);
+		if (res != MAP_FAILED) {
+			// The last page carries whatever follows the segment in the file
+			memset((void *)file_end, 0, map_start + map_size - file_end);
+			return 0;
+		}
+	}
 #endif
+	return so_read(fd, (void *)dst, phdr->p_filesz, phdr->p_offset) ? 0 : -1;
+}
 
-int so_load(const char *filename, void **base_addr) {
-#ifdef USE_INTERPRETER
-	// Set up dynamic memory mapping hooks
-	uc_err err = uc_hook_add(uc, &mem_invalid_hook, UC_HOOK_MEM_INVALID, (void*)unmappedMemoryHook, NULL, 0, ~u64(0));
-	if (err) {
-		debugLog("Failed to setup dynamic memory handler %u (%s)\n", err, uc_strerror(err));
+static int64_t so_read_sleb128(const uint8_t **p, const uint8_t *end) {
+	int64_t value = 0;
+	unsigned shift = 0;
+	uint8_t byte;
+	do {
+		if (*p >= end)
+			return 0;
+		byte = *(*p)++;
+		if (shift < 64)
+			value |= (int64_t)(byte & 0x7F) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	if (shift < 64 && (byte & 0x40))
+		value |= -((int64_t)1 << shift);
+	return value;
+}
+
+#define APS2_GROUPED_BY_INFO (1)
+#define APS2_GROUPED_BY_OFFSET_DELTA (2)
+#define APS2_GROUPED_BY_ADDEND (4)
+#define APS2_GROUP_HAS_ADDEND (8)
+
+// Android packed relocations: "APS2" followed by sleb128 encoded groups of relocations that
+// may share their offset delta, info and addend. They get unpacked once in packed_relas.
+static bool so_unpack_aps2(so_module *m, const uint8_t *data, size_t size) {
+	const uint8_t *end = data + size;
+	if (size < 4 || memcmp(data, "APS2", 4) != 0)
+		return false;
+
+	const uint8_t *p = data + 4;
+	int64_t count = so_read_sleb128(&p, end);
+	Elf64_Rela rel = {};
+	rel.r_offset = so_read_sleb128(&p, end);
+	// Every relocation patches its own 8 byte slot of the image, more can only come from a
+	// malformed table. Fully grouped relocations take no bytes, so only reserve what the table
+	// could hold one byte each and let anything denser grow.
+	if (count < 0 || (uint64_t)count > m->load_size / sizeof(uint64_t))
+		return false;
+	m->packed_relas.reserve(std::min<size_t>(count, size));
+	while ((int64_t)m->packed_relas.size() < count) {
+		int64_t group_size = so_read_sleb128(&p, end);
+		int64_t flags = so_read_sleb128(&p, end);
+		if (p >= end || group_size <= 0 || group_size > count - (int64_t)m->packed_relas.size())
+			return false;
+
+		int64_t offset_delta = 0;
+		if (flags & APS2_GROUPED_BY_OFFSET_DELTA)
+			offset_delta = so_read_sleb128(&p, end);
+		if (flags & APS2_GROUPED_BY_INFO)
+			rel.r_info = so_read_sleb128(&p, end);
+		if ((flags & APS2_GROUP_HAS_ADDEND) && (flags & APS2_GROUPED_BY_ADDEND))
+			rel.r_addend += so_read_sleb128(&p, end);
+		else if (!(flags & APS2_GROUP_HAS_ADDEND))
+			rel.r_addend = 0;
+
+		for (int64_t i = 0; i < group_size; i++) {
+			rel.r_offset += (flags & APS2_GROUPED_BY_OFFSET_DELTA) ? offset_delta : so_read_sleb128(&p, end);
+			if (!(flags & APS2_GROUPED_BY_INFO))
+				rel.r_info = so_read_sleb128(&p, end);
+			if ((flags & APS2_GROUP_HAS_ADDEND) && !(flags & APS2_GROUPED_BY_ADDEND))
+				rel.r_addend += so_read_sleb128(&p, end);
+			m->packed_relas.push_back(rel);
+		}
+	}
+	return true;
+}
+
+// Collects dependencies and relocation tables from PT_DYNAMIC
+static int so_read_dynamic(so_module *m) {
+	uintptr_t rela = 0, jmprel = 0, aps2 = 0, relr = 0;
+	size_t rela_size = 0, jmprel_size = 0, aps2_size = 0, relr_size = 0;
+
+	for (int i = 0; i < m->ehdr.e_phnum; i++) {
+		if (m->prog_hdr[i].p_type != PT_DYNAMIC)
+			continue;
+		for (Elf64_Dyn *dyn = (Elf64_Dyn *)(m->base + m->prog_hdr[i].p_vaddr); dyn->d_tag != DT_NULL; dyn++) {
+			switch (dyn->d_tag) {
+			case DT_NEEDED:
+				m->needed.push_back(m->dynstrtab + dyn->d_un.d_val);
+				break;
+			case DT_SONAME:
+				m->name = m->dynstrtab + dyn->d_un.d_val;
+				break;
+			case DT_RELA:
+				rela = m->base + dyn->d_un.d_ptr;
+				break;
+			case DT_RELASZ:
+				rela_size = dyn->d_un.d_val;
+				break;
+			case DT_JMPREL:
+				jmprel = m->base + dyn->d_un.d_ptr;
+				break;
+			case DT_PLTRELSZ:
+				jmprel_size = dyn->d_un.d_val;
+				break;
+			case DT_ANDROID_RELA:
+				aps2 = m->base + dyn->d_un.d_ptr;
+				break;
+			case DT_ANDROID_RELASZ:
+				aps2_size = dyn->d_un.d_val;
+				break;
+			case DT_RELR:
+			case DT_ANDROID_RELR:
+				relr = m->base + dyn->d_un.d_ptr;
+				break;
+			case DT_RELRSZ:
+			case DT_ANDROID_RELRSZ:
+				relr_size = dyn->d_un.d_val;
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	if (aps2 && !so_unpack_aps2(m, (const uint8_t *)aps2, aps2_size)) {
+		debugLog("%s: malformed packed relocations\n", m->name.c_str());
 		return -1;
 	}
-#endif
+	if (rela)
+		m->rela_tables.push_back({(Elf64_Rela *)rela, rela_size / sizeof(Elf64_Rela)});
+	if (!m->packed_relas.empty())
+		m->rela_tables.push_back(m->packed_relas);
+	if (jmprel)
+		m->rela_tables.push_back({(Elf64_Rela *)jmprel, jmprel_size / sizeof(Elf64_Rela)});
+	if (relr)
+		m->relr = {(const uint64_t *)relr, relr_size / sizeof(uint64_t)};
+
+	debugLog("%s: %llu RELA (%llu packed), %llu RELR entries\n", m->name.c_str(), rela_size / sizeof(Elf64_Rela) + jmprel_size / sizeof(Elf64_Rela),
+		m->packed_relas.size(), m->relr.size());
+	return 0;
+}
+
+static so_module *so_module_at(uintptr_t addr) {
+	for (so_module *m : so_modules) {
+		if (addr >= (uintptr_t)m->load_base && addr < (uintptr_t)m->load_base + m->load_size)
+			return m;
+	}
+	return NULL;
+}
+
+static so_module *so_module_by_name(const char *name) {
+	for (so_module *m : so_modules) {
+		if (m->name == name)
+			return m;
+	}
+	return NULL;
+}
+
+static int so_load_module(const char *filename, so_module **out) {
 	int res = 0;
-	size_t so_size = 0;
-	int text_segno = -1;
-	int data_segno = -1;
+	uintptr_t min_vaddr = UINTPTR_MAX;
+	uintptr_t max_vaddr = 0;
+	uintptr_t prev_end;
+	const char *basename;
+	Elf64_Ehdr *elf_hdr;
+	so_module *m = NULL;
+	struct stat st;
 
 	FILE *fd = fopen(filename, "rb");
 	if (fd == NULL)
 		return -1;
 
-	fseek(fd, 0, SEEK_END);
-	so_size = ftell(fd);
-	fseek(fd, 0, SEEK_SET);
+	m = new so_module();
+	m->path = filename;
+	basename = strrchr(filename, '/');
+	m->name = basename ? basename + 1 : filename;
 
-	so_base = malloc(so_size);
-	if (!so_base) {
-		fclose(fd);
-		return -2;
+	// Only headers are read in memory, segments get mapped in place later on
+	elf_hdr = &m->ehdr;
+	if (!so_read(fd, elf_hdr, sizeof(Elf64_Ehdr), 0) || memcmp(elf_hdr->e_ident, ELFMAG, SELFMAG) != 0) {
+		res = -1;
+		goto err_free_hdr;
 	}
 
-	fread(so_base, so_size, 1, fd);
-	fclose(fd);
-
-	if (memcmp(so_base, ELFMAG, SELFMAG) != 0) {
+	m->prog_hdr = (Elf64_Phdr *)malloc(elf_hdr->e_phnum * sizeof(Elf64_Phdr));
+	m->sec_hdr = (Elf64_Shdr *)malloc(elf_hdr->e_shnum * sizeof(Elf64_Shdr));
+	if (!m->prog_hdr || !m->sec_hdr) {
+		res = -2;
+		goto err_free_hdr;
+	}
+	if (!so_read(fd, m->prog_hdr, elf_hdr->e_phnum * sizeof(Elf64_Phdr), elf_hdr->e_phoff) ||
+		!so_read(fd, m->sec_hdr, elf_hdr->e_shnum * sizeof(Elf64_Shdr), elf_hdr->e_shoff)) {
 		res = -1;
-		goto err_free_so;
+		goto err_free_hdr;
+	}
+
+	m->shstrtab = (char *)malloc(m->sec_hdr[elf_hdr->e_shstrndx].sh_size);
+	if (!m->shstrtab || !so_read(fd, m->shstrtab, m->sec_hdr[elf_hdr->e_shstrndx].sh_size, m->sec_hdr[elf_hdr->e_shstrndx].sh_offset)) {
+		res = -2;
+		goto err_free_hdr;
 	}
 
-	elf_hdr = (Elf64_Ehdr *)so_base;
-	prog_hdr = (Elf64_Phdr *)((uintptr_t)so_base + elf_hdr->e_phoff);
-	sec_hdr = (Elf64_Shdr *)((uintptr_t)so_base + elf_hdr->e_shoff);
-	shstrtab = (char *)((uintptr_t)so_base + sec_hdr[elf_hdr->e_shstrndx].sh_offset);
+	// Identity of the file, used to validate the image cache
+	if (fstat(fileno(fd), &st) == 0)
+		m->file_size = st.st_size;
+	m->hdr_hash = so_hash(2166136261u, elf_hdr, sizeof(Elf64_Ehdr));
+	m->hdr_hash = so_hash(m->hdr_hash, m->prog_hdr, elf_hdr->e_phnum * sizeof(Elf64_Phdr));
+	m->hdr_hash = so_hash(m->hdr_hash, m->sec_hdr, elf_hdr->e_shnum * sizeof(Elf64_Shdr));
 
-	// calculate total size of the LOAD segments
+	// The block spans from the first to the last PT_LOAD segment, whatever their number
 	for (int i = 0; i < elf_hdr->e_phnum; i++) {
-		if (prog_hdr[i].p_type == PT_LOAD) {
-			const size_t prog_size = ALIGN_MEM(prog_hdr[i].p_memsz, prog_hdr[i].p_align);
-			// get the segment numbers of text and data segments
-			if ((prog_hdr[i].p_flags & PF_X) == PF_X) {
-				text_segno = i;
-			} else {
-				// assume data has to be after text
-				if (text_segno < 0)
-					goto err_free_so;
-				data_segno = i;
-				// since data is after text, total program size = last_data_offset + last_data_aligned_size
-				load_size = prog_hdr[i].p_vaddr + prog_size;
-			}
+		if (m->prog_hdr[i].p_type == PT_LOAD) {
+			min_vaddr = std::min(min_vaddr, (uintptr_t)(m->prog_hdr[i].p_vaddr & ~0xFFFULL));
+			max_vaddr = std::max(max_vaddr, (uintptr_t)(m->prog_hdr[i].p_vaddr + m->prog_hdr[i].p_memsz));
 		}
 	}
+	if (min_vaddr >= max_vaddr) {
+		res = -1;
+		goto err_free_hdr;
+	}
 
 	// align total size to page size
-	load_size = ALIGN_MEM(load_size, 0x1000);
-	if (load_size > DYNAREC_MEMBLK_SIZE) {
+	m->load_size = ALIGN_MEM(max_vaddr - min_vaddr, 0x1000);
+	if (m->load_size > DYNAREC_MEMBLK_SIZE) {
 		res = -3;
-		goto err_free_so;
+		goto err_free_hdr;
 	}
-	debugLog("Total LOAD size: %llu bytes\n", load_size);
+	debugLog("%s: total LOAD size: %llu bytes\n", m->name.c_str(), m->load_size);
 
 	// allocate space for all load segments (align to page size)
-	debugLog("Allocating dynarec memblock of %llu bytes\n", load_size);
-	load_base = memalign(0x1000, load_size);
-	if (!load_base)
-		goto err_free_so;
-	memset(load_base, 0, load_size);
-
-#ifdef USE_INTERPRETER
-	err = uc_mem_map_ptr(uc, (uintptr_t)load_base, load_size, UC_PROT_ALL, load_base);
-	if (err) {
-		debugLog("Failed to map ELF memory %u (%s)\n", err, uc_strerror(err));
-		return -1;
+	debugLog("Allocating dynarec memblock of %llu bytes\n", m->load_size);
+	m->load_base = guest_mem_alloc(m->load_size);
+	if (!m->load_base) {
+		res = -2;
+		goto err_free_hdr;
 	}
+	m->base = (uintptr_t)m->load_base - min_vaddr;
 
-	err = uc_mem_map(uc, (uintptr_t)HOOKS_BASE_ADDRESS, HOOKS_BLOCK_SIZE, UC_PROT_ALL);
-	if (err) {
-		debugLog("Failed to allocate region for function hooks\n");
-		return -1;
+#ifdef USE_INTERPRETER
+	if (!so_uc_map((uintptr_t)m->load_base, m->load_size)) {
+		debugLog("Failed to map ELF memory\n");
+		res = -1;
+		goto err_free_load;
 	}
 #endif
-	
-	// copy segments to where they belong
-
-	// text
-	text_size = prog_hdr[text_segno].p_memsz;
-	text_base = (void *)(prog_hdr[text_segno].p_vaddr + (Elf64_Addr)load_base);
-	prog_hdr[text_segno].p_vaddr = (Elf64_Addr)text_base;
-	memcpy(text_base, (void *)((uintptr_t)so_base + prog_hdr[text_segno].p_offset), prog_hdr[text_segno].p_filesz);
 
-	// data
-	data_size = prog_hdr[data_segno].p_memsz;
-	data_base = (void *)(prog_hdr[data_segno].p_vaddr + (Elf64_Addr)load_base);
-	prog_hdr[data_segno].p_vaddr = (Elf64_Addr)data_base;
-	memcpy(data_base, (void *)((uintptr_t)so_base + prog_hdr[data_segno].p_offset), prog_hdr[data_segno].p_filesz);
-
-	syms = NULL;
-	dynstrtab = NULL;
+	// copy segments to where they belong, PT_LOAD entries are sorted by address. The content
+	// hash is taken before anything gets relocated, it identifies the file for the image cache.
+	prev_end = (uintptr_t)m->load_base;
+	m->content_hash = 14695981039346656037ULL;
+	for (int i = 0; i < elf_hdr->e_phnum; i++) {
+		Elf64_Phdr *phdr = &m->prog_hdr[i];
+		if (phdr->p_type != PT_LOAD)
+			continue;
+		if (so_map_segment(fd, phdr, m->base + phdr->p_vaddr, prev_end)) {
+			res = -4;
+			goto err_free_load;
+		}
+		m->content_hash = so_hash64(m->content_hash, (void *)(m->base + phdr->p_vaddr), phdr->p_filesz);
+		prev_end = m->base + phdr->p_vaddr + phdr->p_memsz;
+	}
+	fclose(fd);
+	fd = NULL;
 
 	for (int i = 0; i < elf_hdr->e_shnum; i++) {
-		char *sh_name = shstrtab + sec_hdr[i].sh_name;
+		char *sh_name = m->shstrtab + m->sec_hdr[i].sh_name;
 		if (strcmp(sh_name, ".dynsym") == 0) {
-			syms = (Elf64_Sym *)((uintptr_t)text_base + sec_hdr[i].sh_addr);
-			num_syms = sec_hdr[i].sh_size / sizeof(Elf64_Sym);
+			m->syms = (Elf64_Sym *)(m->base + m->sec_hdr[i].sh_addr);
+			m->num_syms = m->sec_hdr[i].sh_size / sizeof(Elf64_Sym);
 		} else if (strcmp(sh_name, ".dynstr") == 0) {
-			dynstrtab = (char *)((uintptr_t)text_base + sec_hdr[i].sh_addr);
+			m->dynstrtab = (char *)(m->base + m->sec_hdr[i].sh_addr);
+			m->dynstr_size = m->sec_hdr[i].sh_size;
 		}
 	}
-	
-	*base_addr = load_base;
 
-	if (syms == NULL || dynstrtab == NULL) {
+	if (m->syms == NULL || m->dynstrtab == NULL) {
 		res = -2;
 		goto err_free_load;
 	}
 
+	if (so_read_dynamic(m)) {
+		res = -5;
+		goto err_free_load;
+	}
+
+	// Modules get their static TLS in load order
+	for (int i = 0; i < elf_hdr->e_phnum; i++) {
+		if (m->prog_hdr[i].p_type == PT_TLS && m->prog_hdr[i].p_memsz) {
+			size_t align = std::max<size_t>(m->prog_hdr[i].p_align, 1);
+			m->tls_image = m->base + m->prog_hdr[i].p_vaddr;
+			m->tls_filesz = m->prog_hdr[i].p_filesz;
+			m->tls_memsz = m->prog_hdr[i].p_memsz;
+			m->tls_offset = ALIGN_MEM(so_tls_size, align);
+			so_tls_size = m->tls_offset + m->tls_memsz;
+			so_tls_align = std::max(so_tls_align, align);
+			debugLog("%s: %llu bytes of TLS at TPIDR_EL0 + 0x%llx\n", m->name.c_str(), m->tls_memsz, m->tls_offset);
+		}
+	}
+
+	so_build_symbol_index(m);
+
+	*out = m;
 	return 0;
 
 err_free_load:
-#ifdef __MINGW64__
-	_aligned_free(load_base);
-#else
-	free(load_base);
-#endif
-err_free_so:
-	free(so_base);
+	guest_mem_free(m->load_base, m->load_size);
+err_free_hdr:
+	free(m->prog_hdr);
+	free(m->sec_hdr);
+	free(m->shstrtab);
+	delete m;
+	if (fd)
+		fclose(fd);
 
 	return res;
 }
 
+int so_load(const char *filename, void **base_addr) {
 #ifdef USE_INTERPRETER
-static void unresolved_symbol_hook(uc_engine *uc, uint64_t address, uint32_t size, void *user_data)
-{
-	uint64_t ra;
-	uc_reg_read(uc, REG_FP, &ra);
-	printf("Unresolved symbol called from %llx\n", ra - (uintptr_t)dynarec_base_addr);
-	abort();
-}
-#endif
+	// Set up dynamic memory mapping hooks
+	uc_err err = uc_hook_add(uc, &mem_invalid_hook, UC_HOOK_MEM_INVALID, (void*)unmappedMemoryHook, NULL, 0, ~u64(0));
+	if (err) {
+		debugLog("Failed to setup dynamic memory handler %u (%s)\n", err, uc_strerror(err));
+		return -1;
+	}
 
-uintptr_t get_trampoline(const char *name, dynarec_import *funcs, int num_funcs)
-{
-#ifdef USE_INTERPRETER
-	static bool unresolved_symbol_mapped = false;
-	if (!unresolved_symbol_mapped) {
-		unresolved_symbol_mapped = true;
-		auto hook = hooks.emplace_back();
-		uc_hook_add(uc, &hook, UC_HOOK_CODE, (void *)unresolved_symbol_hook, NULL, HOOKS_BASE_ADDRESS + HOOKS_BLOCK_SIZE - 4, HOOKS_BASE_ADDRESS + HOOKS_BLOCK_SIZE - 4);
+	// Allocated on its own, modules loaded later on may end up right after the main one
+	hooks_base = (uintptr_t)guest_mem_alloc(HOOKS_BLOCK_SIZE);
+	if (!hooks_base || !so_uc_map(hooks_base, HOOKS_BLOCK_SIZE)) {
+		debugLog("Failed to allocate region for function hooks\n");
+		return -1;
 	}
-#endif
+	memcpy((void *)TLSDESC_RESOLVER, tlsdesc_static_resolver, sizeof(tlsdesc_static_resolver));
 
-	for (int k = 0; k < num_funcs; k++) {
-		if (strcmp(name, funcs[k].symbol) == 0) {
-			if (funcs[k].ptr == (uintptr_t)NULL) {
-#ifdef USE_INTERPRETER
-				if (!funcs[k].mapped) {
-					uint32_t nop = 0xD503201F;
-					auto hook = hooks.emplace_back();
-					//debugLog("%s %llx hook on %llx\n", name, (uintptr_t)funcs[k].trampoline / 4, HOOKS_BASE_ADDRESS + (uintptr_t)funcs[k].trampoline - (uintptr_t)load_base);
-					uc_hook_add(uc, &hook, UC_HOOK_CODE, (void *)hook_import, NULL, HOOKS_BASE_ADDRESS + (uintptr_t)funcs[k].trampoline, HOOKS_BASE_ADDRESS + (uintptr_t)funcs[k].trampoline);
-					uc_mem_write(uc, HOOKS_BASE_ADDRESS + (uintptr_t)funcs[k].trampoline, &nop, 4);
-					funcs[k].mapped = true;
-				}
-				return HOOKS_BASE_ADDRESS + (uintptr_t)funcs[k].trampoline;
-#else
-				return (uintptr_t)funcs[k].trampoline;
+	// Import trampolines at the start of the block, the unresolved import stub at its very end
+	const uint32_t unresolved_stub = DYNAREC_SVC(DYNAREC_SVC_UNRESOLVED);
+	if (dynarec_imports_num * sizeof(dynarec_imports_trampolines[0]) > HOOKS_TRAMPOLINES_SIZE) {
+		debugLog("Too many imports for the function hooks region\n");
+		return -1;
+	}
+	memcpy((void *)HOOKS_BASE_ADDRESS, dynarec_imports_trampolines, dynarec_imports_num * sizeof(dynarec_imports_trampolines[0]));
+	memcpy((void *)(HOOKS_BASE_ADDRESS + HOOKS_UNRESOLVED_OFFSET), &unresolved_stub, sizeof(unresolved_stub));
+	err = uc_hook_add(uc, &svc_hook, UC_HOOK_INTR, (void *)hook_svc, NULL, 1, 0);
+	if (err) {
+		debugLog("Failed to setup SVC handler %u (%s)\n", err, uc_strerror(err));
+		return -1;
+	}
 #endif
-			} else {	
-				return (uintptr_t)funcs[k].symbol;
+	so_module *m;
+	int res = so_load_module(filename, &m);
+	if (res)
+		return res;
+	so_modules.push_back(m);
+	*base_addr = m->load_base;
+
+	// text and data of the main module, as seen by the port
+	for (int i = 0; i < m->ehdr.e_phnum; i++) {
+		if (m->prog_hdr[i].p_type != PT_LOAD)
+			continue;
+		if ((m->prog_hdr[i].p_flags & PF_X) == PF_X) {
+			if (!text_base) {
+				text_base = (void *)(m->base + m->prog_hdr[i].p_vaddr);
+				text_size = m->prog_hdr[i].p_memsz;
 			}
+		} else if (text_base && !data_base) {
+			data_base = (void *)(m->base + m->prog_hdr[i].p_vaddr);
+			data_size = m->prog_hdr[i].p_memsz;
 		}
 	}
-	
+
+	// Dependencies are looked up next to the main ELF. Whatever isn't shipped with the
+	// game (libc, libm, liblog...) is left to the host imports.
+	std::string dir = filename;
+	dir.erase(dir.find_last_of('/') + 1);
+	for (size_t i = 0; i < so_modules.size(); i++) {
+		for (const char *needed : so_modules[i]->needed) {
+			if (so_module_by_name(needed))
+				continue;
+			std::string path = dir + needed;
+			struct stat st;
+			if (stat(path.c_str(), &st) != 0) {
+				debugLog("%s: %s not found, relying on host imports\n", so_modules[i]->name.c_str(), needed);
+				continue;
+			}
+			so_module *dep;
+			res = so_load_module(path.c_str(), &dep);
+			if (res) {
+				printf("Failed to load %s needed by %s (%d)\n", path.c_str(), so_modules[i]->name.c_str(), res);
+				return res;
+			}
+			debugLog("Loaded %s at 0x%llx\n", dep->name.c_str(), dep->load_base);
+			so_modules.push_back(dep);
+		}
+	}
+
+	return 0;
+}
+
+static uintptr_t so_import_trampoline(size_t k)
+{
+#ifdef USE_INTERPRETER
+	// Copies of dynarec_imports_trampolines, see so_load
+	return HOOKS_BASE_ADDRESS + k * sizeof(dynarec_imports_trampolines[0]);
+#else
+	return (uintptr_t)dynarec_imports_trampolines[k].data();
+#endif
+}
+
+uintptr_t get_trampoline(const char *name)
+{
+	const dynarec_thunk *import = so_find_import(name);
+	if (import)
+		return so_import_trampoline(import - dynarec_imports);
+
 	// Redirect _ctype_ to BIONIC variant
 	if (strcmp(name, "_ctype_") == 0) {
 #ifdef USE_INTERPRETER
-		uc_mem_write(uc, HOOKS_BASE_ADDRESS + (HOOKS_BLOCK_SIZE - 0x1000), __BIONIC_ctype_, sizeof(__BIONIC_ctype_) * sizeof(*__BIONIC_ctype_));
-		return HOOKS_BASE_ADDRESS + (HOOKS_BLOCK_SIZE - 0x1000);
+		uc_mem_write(uc, HOOKS_BASE_ADDRESS + HOOKS_CTYPE_OFFSET, __BIONIC_ctype_, sizeof(__BIONIC_ctype_) * sizeof(*__BIONIC_ctype_));
+		return HOOKS_BASE_ADDRESS + HOOKS_CTYPE_OFFSET;
 #else
 		return (uintptr_t)__BIONIC_ctype_;
 #endif
 	// Redirect stack guard related pointers
 	} else if (strcmp(name, "__stack_chk_guard") == 0) {
 #ifdef USE_INTERPRETER
-		uc_mem_write(uc, HOOKS_BASE_ADDRESS + (HOOKS_BLOCK_SIZE - 0x1000 - 8), &__stack_chk_guard_fake, 8);
-		return HOOKS_BASE_ADDRESS + (HOOKS_BLOCK_SIZE - 0x1000 - 8);
+		uc_mem_write(uc, HOOKS_BASE_ADDRESS + HOOKS_STACK_CHK_GUARD_OFFSET, &__stack_chk_guard_fake, 8);
+		return HOOKS_BASE_ADDRESS + HOOKS_STACK_CHK_GUARD_OFFSET;
 #else
 		return (uintptr_t)&__stack_chk_guard_fake;
 #endif
 	} else if (strcmp(name, "__stack_chk_fail") == 0) {
 #ifdef USE_INTERPRETER
-		uc_mem_write(uc, HOOKS_BASE_ADDRESS + (HOOKS_BLOCK_SIZE - 0x1000 - 16), &__stack_chk_fail, 8);
-		return HOOKS_BASE_ADDRESS + (HOOKS_BLOCK_SIZE - 0x1000 - 16);
+		uc_mem_write(uc, HOOKS_BASE_ADDRESS + HOOKS_STACK_CHK_FAIL_OFFSET, &__stack_chk_fail, 8);
+		return HOOKS_BASE_ADDRESS + HOOKS_STACK_CHK_FAIL_OFFSET;
 #else
 		return __stack_chk_fail;
 #endif
 	// Redirect stderr to fake one so that we can intercept it in __aarch64_fprintf
 	} else if (strcmp(name, "stderr") == 0) {
 #ifdef USE_INTERPRETER
-		uc_mem_write(uc, HOOKS_BASE_ADDRESS + (HOOKS_BLOCK_SIZE - 0x1000 - 24), &stderr_fake, 8);
-		return HOOKS_BASE_ADDRESS + (HOOKS_BLOCK_SIZE - 0x1000 - 24);
+		uc_mem_write(uc, HOOKS_BASE_ADDRESS + HOOKS_STDERR_OFFSET, &stderr_fake, 8);
+		return HOOKS_BASE_ADDRESS + HOOKS_STDERR_OFFSET;
 #else
 		return (uintptr_t)&stderr_fake;
 #endif
@@ -488,84 +1240,460 @@ uintptr_t get_trampoline(const char *name, dynarec_import *funcs, int num_funcs)
 	
 	debugLog("Unresolved import: %s\n", name);
 #ifdef USE_INTERPRETER
-	return (uintptr_t)HOOKS_BASE_ADDRESS + HOOKS_BLOCK_SIZE - 4;
+	return (uintptr_t)HOOKS_BASE_ADDRESS + HOOKS_UNRESOLVED_OFFSET;
 #else
 	return (uintptr_t)unresolved_stub_token;
 #endif
 }
 
-int so_relocate() {
-	for (int i = 0; i < elf_hdr->e_shnum; i++) {
-		char *sh_name = shstrtab + sec_hdr[i].sh_name;
-		if (strcmp(sh_name, ".rela.dyn") == 0 || strcmp(sh_name, ".rela.plt") == 0) {
-			Elf64_Rela *rels = (Elf64_Rela *)((uintptr_t)text_base + sec_hdr[i].sh_addr);
-			for (int j = 0; j < sec_hdr[i].sh_size / sizeof(Elf64_Rela); j++) {
-				uintptr_t *ptr = (uintptr_t *)((uintptr_t)text_base + rels[j].r_offset);
-				Elf64_Sym *sym = &syms[ELF64_R_SYM(rels[j].r_info)];
-
-				int type = ELF64_R_TYPE(rels[j].r_info);
-				uintptr_t target;
-				switch (type) {
-					case R_AARCH64_RELATIVE:
-						target = (uintptr_t)text_base + rels[j].r_addend;
-						memcpy(ptr, &target, sizeof(uintptr_t));
-						break;
-					case R_AARCH64_ABS64:
-						target = *ptr + (uintptr_t)text_base + sym->st_value + rels[j].r_addend;
-						memcpy(ptr, &target, sizeof(uintptr_t));
-						break;
-					case R_AARCH64_GLOB_DAT:
-					case R_AARCH64_JUMP_SLOT:
-					{
-						if (sym->st_shndx != SHN_UNDEF) {
-							target = (uintptr_t)text_base + sym->st_value + rels[j].r_addend;
-							memcpy(ptr, &target, sizeof(uintptr_t));
-						}
-						break;
-					}
+// Thread pointer relative offsets, resolved statically for both models
+static void so_relocate_tls(uintptr_t *ptr, int type, uintptr_t offset) {
+	if (type == R_AARCH64_TLSDESC) {
+		ptr[0] = TLSDESC_RESOLVER;
+		ptr[1] = offset;
+	} else {
+		*ptr = offset;
+	}
+}
 
-					default:
-						debugLog("Error: unknown relocation type:\n%x\n", type);
-						break;
-				}
+static void so_relocate_rela(so_module *m, Elf64_Rela *rel) {
+	uintptr_t *ptr = (uintptr_t *)(m->base + rel->r_offset);
+	Elf64_Sym *sym = &m->syms[ELF64_R_SYM(rel->r_info)];
+
+	int type = ELF64_R_TYPE(rel->r_info);
+	uintptr_t target;
+	switch (type) {
+		case R_AARCH64_RELATIVE:
+			target = m->base + rel->r_addend;
+			memcpy(ptr, &target, sizeof(uintptr_t));
+			break;
+		case R_AARCH64_ABS64:
+			// Undefined symbols are bound by so_resolve
+			if (sym->st_shndx != SHN_UNDEF || ELF64_R_SYM(rel->r_info) == 0) {
+				target = *ptr + m->base + sym->st_value + rel->r_addend;
+				memcpy(ptr, &target, sizeof(uintptr_t));
 			}
+			break;
+		case R_AARCH64_GLOB_DAT:
+		case R_AARCH64_JUMP_SLOT:
+		{
+			if (sym->st_shndx != SHN_UNDEF) {
+				target = m->base + sym->st_value + rel->r_addend;
+				memcpy(ptr, &target, sizeof(uintptr_t));
+			}
+			break;
+		}
+		case R_AARCH64_TLS_TPREL:
+		case R_AARCH64_TLSDESC:
+			// Undefined symbols are bound by so_resolve
+			if (sym->st_shndx != SHN_UNDEF || ELF64_R_SYM(rel->r_info) == 0)
+				so_relocate_tls(ptr, type, m->tls_offset + sym->st_value + rel->r_addend);
+			break;
+
+		default:
+			debugLog("Error: unknown relocation type:\n%x\n", type);
+			break;
+	}
+}
+
+#define SO_RELOC_CHUNK (4096) // Relocations handed to a worker at once
+
+// A slice of one of the relocation tables of a module
+typedef struct {
+	so_module *m;
+	std::span<Elf64_Rela> rels;
+	std::span<const uint64_t> relr;
+} so_reloc_job;
+
+static void so_relocate_job(so_reloc_job *job) {
+	for (Elf64_Rela &rel : job->rels)
+		so_relocate_rela(job->m, &rel);
+	so_for_each_relr(job->m, job->relr.data(), job->relr.data() + job->relr.size(), [m = job->m](uintptr_t *where) {
+		*where += m->base;
+	});
+}
+
+// Every relocation handled here patches its own slot from the module alone, so the tables
+// of all modules are split in chunks and spread across a pool of workers
+int so_relocate() {
+	std::vector<so_reloc_job> jobs;
+	for (so_module *m : so_modules) {
+		if (m->restored)
+			continue;
+		for (auto &table : m->rela_tables) {
+			for (size_t i = 0; i < table.size(); i += SO_RELOC_CHUNK)
+				jobs.push_back({m, table.subspan(i, std::min<size_t>(SO_RELOC_CHUNK, table.size() - i)), {}});
+		}
+		// RELR slices have to start on an address entry
+		const uint64_t *start = m->relr.data();
+		const uint64_t *end = start + m->relr.size();
+		while (start < end) {
+			const uint64_t *split = start + std::min<size_t>(SO_RELOC_CHUNK, end - start);
+			while (split < end && (*split & 1))
+				split++;
+			jobs.push_back({m, {}, {start, split}});
+			start = split;
 		}
 	}
+
+	std::atomic<size_t> next_job = 0;
+	auto worker = [&jobs, &next_job]() {
+		for (size_t i = next_job++; i < jobs.size(); i = next_job++)
+			so_relocate_job(&jobs[i]);
+	};
+	size_t num_workers = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), jobs.size());
+	std::vector<std::thread> workers;
+	for (size_t i = 1; i < num_workers; i++)
+		workers.emplace_back(worker);
+	worker();
+	for (auto &t : workers)
+		t.join();
+
+	debugLog("Relocations applied in %llu chunks by %llu workers\n", jobs.size(), std::max<size_t>(num_workers, 1));
 	return 0;
 }
 
-int so_resolve(dynarec_import *funcs, int num_funcs) {
-	for (int i = 0; i < elf_hdr->e_shnum; i++) {
-		char *sh_name = shstrtab + sec_hdr[i].sh_name;
-		if (strcmp(sh_name, ".rela.dyn") == 0 || strcmp(sh_name, ".rela.plt") == 0) {
-			Elf64_Rela *rels = (Elf64_Rela *)((uintptr_t)text_base + sec_hdr[i].sh_addr);
-			for (int j = 0; j < sec_hdr[i].sh_size / sizeof(Elf64_Rela); j++) {
-				uintptr_t *ptr = (uintptr_t *)((uintptr_t)text_base + rels[j].r_offset);
-				Elf64_Sym *sym = &syms[ELF64_R_SYM(rels[j].r_info)];
-
-				int type = ELF64_R_TYPE(rels[j].r_info);
-				switch (type) {
-					case R_AARCH64_GLOB_DAT:
-					case R_AARCH64_JUMP_SLOT:
-					{
-						if (sym->st_shndx == SHN_UNDEF) {
-							char *name = dynstrtab + sym->st_name;
-							uintptr_t link = get_trampoline(name, funcs, num_funcs);
-							*ptr = (uintptr_t)link;
-						}
-						break;
-					}
+// First definition of a symbol among the loaded modules
+static so_module *so_lookup_global(const char *name, Elf64_Sym **def) {
+	for (so_module *m : so_modules) {
+		Elf64_Sym *sym = so_lookup_sym(m, name);
+		if (sym && sym->st_shndx != SHN_UNDEF && ELF64_ST_BIND(sym->st_info) != STB_LOCAL) {
+			*def = sym;
+			return m;
+		}
+	}
+	return NULL;
+}
+
+// Address of the first definition of a symbol among the loaded modules, 0 if there's none
+static uintptr_t so_find_definition(const char *name) {
+	Elf64_Sym *sym;
+	so_module *m = so_lookup_global(name, &sym);
+	return m ? m->base + sym->st_value : 0;
+}
+
+// Binds an undefined symbol, other modules take precedence over host imports
+static uintptr_t so_resolve_import(const char *name) {
+	uintptr_t addr = so_find_definition(name);
+	return addr ? addr : get_trampoline(name);
+}
+
+// Reached through lazy_bind_token from a PLT stub, which leaves the GOT slot address in X16.
+// Arguments registers are still untouched at this point, so binding the slot and jumping to
+// its target carries on with the original call.
+static void so_lazy_bind(Dynarmic::A64::Jit *jit) {
+	uintptr_t *slot = (uintptr_t *)jit->GetRegister(16);
+	const char *name = so_find_rela_name((uintptr_t)slot);
+	uintptr_t link = so_resolve_import(name);
+	// Several threads may trap on the same slot at once, they all bind it to the same target but
+	// only the one actually updating it counts
+	uintptr_t expected = (uintptr_t)lazy_bind_token;
+	if (std::atomic_ref<uintptr_t>(*slot).compare_exchange_strong(expected, link)) {
+		so_lazy_bound++;
+		debugLog("Lazily bound %s\n", name);
+	}
+	jit->SetPC(link);
+}
 
-					default:
+// Returns the number of import slots that got bound
+int so_resolve(void) {
+	int resolved = 0;
+	for (so_module *m : so_modules) {
+		if (m->restored)
+			continue;
+		so_for_each_rela(m, [m, &resolved](Elf64_Rela *rel) {
+			uintptr_t *ptr = (uintptr_t *)(m->base + rel->r_offset);
+			Elf64_Sym *sym = &m->syms[ELF64_R_SYM(rel->r_info)];
+			if (sym->st_shndx != SHN_UNDEF || ELF64_R_SYM(rel->r_info) == 0)
+				return;
+
+			int type = ELF64_R_TYPE(rel->r_info);
+			switch (type) {
+				case R_AARCH64_ABS64:
+					*ptr = so_resolve_import(m->dynstrtab + sym->st_name) + rel->r_addend;
+					resolved++;
+					break;
+				case R_AARCH64_GLOB_DAT:
+				case R_AARCH64_JUMP_SLOT:
+#ifndef USE_INTERPRETER
+					// PLT slots get bound on first call by so_lazy_bind
+					if (so_lazy_binding && type == R_AARCH64_JUMP_SLOT) {
+						*ptr = (uintptr_t)lazy_bind_token;
+						so_lazy_slots++;
 						break;
+					}
+#endif
+					*ptr = so_resolve_import(m->dynstrtab + sym->st_name);
+					resolved++;
+					break;
+				case R_AARCH64_TLS_TPREL:
+				case R_AARCH64_TLSDESC:
+				{
+					Elf64_Sym *def;
+					so_module *owner = so_lookup_global(m->dynstrtab + sym->st_name, &def);
+					if (owner) {
+						so_relocate_tls(ptr, type, owner->tls_offset + def->st_value + rel->r_addend);
+						resolved++;
+					} else {
+						debugLog("Unresolved TLS symbol: %s\n", m->dynstrtab + sym->st_name);
+					}
+					break;
 				}
+
+				default:
+					break;
+			}
+		});
+	}
+
+	return resolved;
+}
+
+/*
+ * Image cache: every relocated and resolved module is stored next to its ELF along with the
+ * list of slots holding load address dependent values, so that later runs on the same files
+ * can skip so_relocate and so_resolve entirely. Slots pointing inside the module are stored
+ * relative to its load_base, import slots as indices in dynarec_imports, any other resolved
+ * symbol (including definitions from other modules) by name. Slots bound to a symbol keep
+ * their addend in the stored image. TLS offsets are stored as is, the cache is only valid for
+ * the same static TLS layout. A cache is keyed on the content of the module and on the name
+ * and content of every module loaded along with it, so a changed dependency invalidates it too.
+ */
+#define SO_CACHE_MAGIC "ALIMGC04"
+#define SO_CACHE_ALIGN (0x10000) // Image offset in the file, keeps it mappable whatever the host page size
+
+enum {
+	SO_FIXUP_REBASE, // Slot holds an offset from load_base
+	SO_FIXUP_IMPORT, // value is an index in dynarec_imports
+	SO_FIXUP_NAMED,  // value is the .dynstr offset of the symbol name, resolved with so_resolve_import
+	SO_FIXUP_TLSDESC, // Slot holds the TLSDESC resolver
+};
+
+typedef struct {
+	char magic[8];
+	uint64_t file_size;
+	uint64_t content_hash;
+	uint64_t modules_hash; // Names and content hashes of every loaded module, in load order
+	uint32_t hdr_hash;
+	uint32_t imports_signature;
+	uint32_t tls_layout_hash;
+	uint32_t pad;
+	uint64_t load_size;
+	uint64_t num_fixups;
+} so_cache_hdr;
+
+typedef struct {
+	uint32_t offset; // From load_base
+	uint32_t type;
+	uint64_t value;
+} so_cache_fixup;
+
+static void so_cache_fill_hdr(so_module *m, so_cache_hdr *hdr) {
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, SO_CACHE_MAGIC, sizeof(hdr->magic));
+	hdr->file_size = m->file_size;
+	hdr->content_hash = m->content_hash;
+	hdr->hdr_hash = m->hdr_hash;
+	hdr->imports_signature = dynarec_imports_signature;
+	hdr->load_size = m->load_size;
+	hdr->tls_layout_hash = 2166136261u;
+	hdr->modules_hash = 14695981039346656037ULL;
+	for (so_module *mod : so_modules) {
+		hdr->modules_hash = so_hash64(hdr->modules_hash, mod->name.c_str(), mod->name.size() + 1);
+		hdr->modules_hash = so_hash64(hdr->modules_hash, &mod->content_hash, sizeof(mod->content_hash));
+		hdr->tls_layout_hash = so_hash(hdr->tls_layout_hash, &mod->tls_offset, sizeof(mod->tls_offset));
+		hdr->tls_layout_hash = so_hash(hdr->tls_layout_hash, &mod->tls_memsz, sizeof(mod->tls_memsz));
+	}
+}
+
+static int so_cache_save_module(so_module *m, const char *filename) {
+	// Slots are made position independent in a copy of the image
+	uint8_t *image = (uint8_t *)malloc(m->load_size);
+	if (!image)
+		return -1;
+	memcpy(image, m->load_base, m->load_size);
+
+	std::vector<so_cache_fixup> fixups;
+	so_for_each_rela(m, [m, image, &fixups](Elf64_Rela *rel) {
+		Elf64_Sym *sym = &m->syms[ELF64_R_SYM(rel->r_info)];
+		uint32_t offset = m->base + rel->r_offset - (uintptr_t)m->load_base;
+		uintptr_t *slot = (uintptr_t *)(image + offset);
+		int type = ELF64_R_TYPE(rel->r_info);
+		switch (type) {
+		case R_AARCH64_RELATIVE:
+		case R_AARCH64_ABS64:
+		case R_AARCH64_GLOB_DAT:
+		case R_AARCH64_JUMP_SLOT:
+			if (sym->st_shndx != SHN_UNDEF || ELF64_R_SYM(rel->r_info) == 0) {
+				*slot -= (uintptr_t)m->load_base;
+				fixups.push_back({offset, SO_FIXUP_REBASE, 0});
+			} else {
+				*slot = type == R_AARCH64_ABS64 ? rel->r_addend : 0;
+				const char *name = m->dynstrtab + sym->st_name;
+				const dynarec_thunk *import = so_find_definition(name) ? NULL : so_find_import(name);
+				if (import)
+					fixups.push_back({offset, SO_FIXUP_IMPORT, (uint64_t)(import - dynarec_imports)});
+				else
+					fixups.push_back({offset, SO_FIXUP_NAMED, sym->st_name});
 			}
+			break;
+		case R_AARCH64_TLSDESC:
+			*slot = 0;
+			fixups.push_back({offset, SO_FIXUP_TLSDESC, 0});
+			break;
+		default:
+			break;
+		}
+	});
+	so_for_each_relr(m, m->relr.data(), m->relr.data() + m->relr.size(), [m, image, &fixups](uintptr_t *where) {
+		uint32_t offset = (uintptr_t)where - (uintptr_t)m->load_base;
+		*(uintptr_t *)(image + offset) -= (uintptr_t)m->load_base;
+		fixups.push_back({offset, SO_FIXUP_REBASE, 0});
+	});
+
+	so_cache_hdr hdr;
+	so_cache_fill_hdr(m, &hdr);
+	hdr.num_fixups = fixups.size();
+
+	// Written aside and renamed over the cache, a crash or an overlapping run never leaves a
+	// valid header in front of a partial image
+	int res = -1;
+	std::string tmp_filename = std::string(filename) + ".tmp";
+	FILE *fd = fopen(tmp_filename.c_str(), "wb");
+	if (fd) {
+		static const uint8_t pad[SO_CACHE_ALIGN] = {};
+		size_t fixups_size = fixups.size() * sizeof(so_cache_fixup);
+		size_t pad_size = ALIGN_MEM(sizeof(hdr) + fixups_size, SO_CACHE_ALIGN) - sizeof(hdr) - fixups_size;
+		if (fwrite(&hdr, sizeof(hdr), 1, fd) == 1 &&
+			(!fixups_size || fwrite(fixups.data(), fixups_size, 1, fd) == 1) &&
+			(!pad_size || fwrite(pad, pad_size, 1, fd) == 1) &&
+			fwrite(image, m->load_size, 1, fd) == 1 &&
+			fflush(fd) == 0)
+			res = 0;
+		if (fclose(fd) != 0)
+			res = -1;
+#ifdef __MINGW64__
+		if (!res && !MoveFileExA(tmp_filename.c_str(), filename, MOVEFILE_REPLACE_EXISTING))
+#else
+		if (!res && rename(tmp_filename.c_str(), filename) != 0)
+#endif
+			res = -1;
+		if (res)
+			remove(tmp_filename.c_str());
+	}
+	free(image);
+
+	debugLog("Image cache %s %s (%llu fixups)\n", filename, res ? "could not be written" : "written", fixups.size());
+	return res;
+}
+
+// Fixups come from the file, nothing they point at may lie outside the module or its tables
+static bool so_cache_check_fixup(so_module *m, const so_cache_fixup *f) {
+	if (f->offset > m->load_size - sizeof(uintptr_t))
+		return false;
+	switch (f->type) {
+	case SO_FIXUP_REBASE:
+	case SO_FIXUP_TLSDESC:
+		return true;
+	case SO_FIXUP_IMPORT:
+		return f->value < dynarec_imports_num;
+	case SO_FIXUP_NAMED:
+		return f->value < m->dynstr_size;
+	default:
+		return false;
+	}
+}
+
+static int so_cache_load_module(so_module *m, const char *filename) {
+	FILE *fd = fopen(filename, "rb");
+	if (!fd)
+		return -1;
+
+	so_cache_hdr hdr, expected;
+	so_cache_fill_hdr(m, &expected);
+	if (!so_read(fd, &hdr, sizeof(hdr), 0) || memcmp(&hdr, &expected, offsetof(so_cache_hdr, num_fixups)) != 0) {
+		debugLog("Image cache %s is stale\n", filename);
+		fclose(fd);
+		return -1;
+	}
+
+	// Every fixup patches a slot of its own, and the whole image has to be there before anything
+	// gets mapped over what so_load left
+	struct stat st;
+	size_t fixups_size = hdr.num_fixups * sizeof(so_cache_fixup);
+	Elf64_Phdr image = {};
+	image.p_offset = ALIGN_MEM(sizeof(hdr) + fixups_size, SO_CACHE_ALIGN);
+	image.p_filesz = m->load_size;
+	if (hdr.num_fixups > m->load_size / sizeof(uintptr_t) || fstat(fileno(fd), &st) != 0 ||
+		(uint64_t)st.st_size < image.p_offset + image.p_filesz) {
+		debugLog("Image cache %s is truncated or corrupted\n", filename);
+		fclose(fd);
+		return -1;
+	}
+
+	std::vector<so_cache_fixup> fixups(hdr.num_fixups);
+	if (fixups_size && !so_read(fd, fixups.data(), fixups_size, sizeof(hdr))) {
+		fclose(fd);
+		return -1;
+	}
+	for (auto &f : fixups) {
+		if (!so_cache_check_fixup(m, &f)) {
+			debugLog("Image cache %s is corrupted\n", filename);
+			fclose(fd);
+			return -1;
+		}
+	}
+
+	// The image replaces what so_load mapped, pages are shared with the cache file until written
+	int res = so_map_segment(fd, &image, (uintptr_t)m->load_base, (uintptr_t)m->load_base);
+	fclose(fd);
+	if (res)
+		return -1;
+
+	for (auto &f : fixups) {
+		uintptr_t *slot = (uintptr_t *)((uintptr_t)m->load_base + f.offset);
+		switch (f.type) {
+		case SO_FIXUP_REBASE:
+			*slot += (uintptr_t)m->load_base;
+			break;
+		case SO_FIXUP_IMPORT:
+			*slot += so_import_trampoline(f.value);
+			break;
+		case SO_FIXUP_NAMED:
+			*slot += so_resolve_import(m->dynstrtab + f.value);
+			break;
+		case SO_FIXUP_TLSDESC:
+			*slot += TLSDESC_RESOLVER;
+			break;
 		}
 	}
 
+	debugLog("Image cache %s loaded (%llu fixups)\n", filename, hdr.num_fixups);
 	return 0;
 }
 
+// Returns 0 when every module could be restored, so_relocate and so_resolve skip the
+// ones that were
+int so_cache_load(void) {
+	int res = 0;
+	for (so_module *m : so_modules) {
+		if (so_cache_load_module(m, (m->path + ".cache").c_str()) == 0)
+			m->restored = true;
+		else
+			res = -1;
+	}
+	return res;
+}
+
+int so_cache_save(void) {
+	int res = 0;
+	for (so_module *m : so_modules) {
+		if (!m->restored && so_cache_save_module(m, (m->path + ".cache").c_str()))
+			res = -1;
+	}
+	return res;
+}
+
 #ifdef GDB_ENABLED
 uintptr_t gdb_fiber_pc;
 uintptr_t gdb_fiber_fp;
@@ -575,7 +1703,7 @@ uintptr_t gdb_thunk_fp;
 void so_run_fiber(Dynarmic::A64::Jit *jit, uintptr_t entry) {
 	//debugLog("Run 0x%llx with end_program_token %llx\n", entry - (uintptr_t)text_base, end_program_token);
 #ifdef USE_INTERPRETER
-	uintptr_t exit_token = (uintptr_t)load_base;
+	uintptr_t exit_token = (uintptr_t)so_modules[0]->load_base;
 	uc_reg_write(uc, REG_FP, &exit_token);
 	uc_err err;
 	uintptr_t sp, pc, fp;
@@ -587,6 +1715,11 @@ void so_run_fiber(Dynarmic::A64::Jit *jit, uintptr_t entry) {
 		gdb_fiber_fp = fp;
 #endif
 		err = uc_emu_start(uc, entry, fp, 0, 0);
+		if (!err && so_thunk_pending) {
+			// Nested thunk: runs guest code itself, so it can't be called from within the hook
+			so_thunk_pending = false;
+			so_find_thunk(so_pending_thunk)->bridge(so_dynarec);
+		}
 		uc_reg_read(uc, UC_ARM64_REG_PC, &entry);
 		if (entry == exit_token)
 			break;
@@ -595,35 +1728,55 @@ void so_run_fiber(Dynarmic::A64::Jit *jit, uintptr_t entry) {
 		uc_reg_read(uc, UC_ARM64_REG_SP, &sp);
 		uc_reg_read(uc, UC_ARM64_REG_PC, &pc);
 		uc_reg_read(uc, REG_FP, &fp);
-		debugLog("Fatal error in Unicorn: %u %s on PC: %llx, SP: %llx, FP: %llx\n", err, uc_strerror(err), pc - (uintptr_t)load_base, sp, fp - (uintptr_t)load_base);
+		debugLog("Fatal error in Unicorn: %u %s on PC: %llx, SP: %llx, FP: %llx\n", err, uc_strerror(err), pc - (uintptr_t)dynarec_base_addr, sp, fp - (uintptr_t)dynarec_base_addr);
 		std::abort();
 	}
 #else
 	jit->SetRegister(REG_FP, (uintptr_t)end_program_token);
 	jit->SetPC(entry);
 	Dynarmic::HaltReason reason = {};
-	while ((reason = jit->Run()) == Dynarmic::HaltReason::UserDefined2) {
-		auto host_next = (void (*)(void *))(native_funcs[*(uint32_t *)jit->GetPC()]);
-		//debugLog("host_next 0x%llx\n", host_next);
-		host_next((void*)jit);
+	for (;;) {
+		so_flush_dirty_text();
+		reason = jit->Run();
+		if (Dynarmic::Has(reason, Dynarmic::HaltReason::UserDefined2)) {
+			// Nested thunk: it may run other fibers on this instance, so preserve the
+			// return path (PC on the trampoline RET and the caller LR) across it
+			uintptr_t pc = jit->GetPC();
+			uintptr_t lr = jit->GetRegister(REG_FP);
+			so_find_thunk(so_pending_thunk)->bridge(jit);
+			jit->SetRegister(REG_FP, lr);
+			jit->SetPC(pc);
+			continue;
+		}
+		// Guest code got patched or written to, carry on with the fresh blocks
+		if (reason == Dynarmic::HaltReason::CacheInvalidation)
+			continue;
+		break;
 	}
-	if (reason != Dynarmic::HaltReason::UserDefined1) {
-		debugLog("fiber: Execution ended with failure.\n");
+	if (!Dynarmic::Has(reason, Dynarmic::HaltReason::UserDefined1)) {
+		uintptr_t sym_offs = 0;
+		const char *sym = so_find_symbol_name(jit->GetPC(), &sym_offs);
+		so_module *m = so_module_at(jit->GetPC());
+		debugLog("fiber: Execution ended with failure on PC: %llx in %s (%s+0x%llx)\n", jit->GetPC() - (m ? m->base : 0), m ? m->name.c_str() : "??", sym ? sym : "??", sym_offs);
 		std::abort();
 	}
 #endif
 }
 
+// Dependencies get initialized before the modules that need them
 void so_execute_init_array(void) {
 	debugLog("so_execute_init_array called\n");
-	for (int i = 0; i < elf_hdr->e_shnum; i++) {
-		char *sh_name = shstrtab + sec_hdr[i].sh_name;
-		if (strcmp(sh_name, ".init_array") == 0) {
-			int (** init_array)() = (int (**)())((uintptr_t)text_base + sec_hdr[i].sh_addr);
-			for (int j = 0; j < sec_hdr[i].sh_size / 8; j++) {
-				if (init_array[j] != 0) {
-					debugLog("init_array on 0x%llx (%llx)\n", (uintptr_t)init_array[j], (uintptr_t)init_array[j] - (uintptr_t)text_base);
-					so_run_fiber(so_dynarec, (uintptr_t)init_array[j]);
+	for (auto it = so_modules.rbegin(); it != so_modules.rend(); ++it) {
+		so_module *m = *it;
+		for (int i = 0; i < m->ehdr.e_shnum; i++) {
+			char *sh_name = m->shstrtab + m->sec_hdr[i].sh_name;
+			if (strcmp(sh_name, ".init_array") == 0) {
+				int (** init_array)() = (int (**)())(m->base + m->sec_hdr[i].sh_addr);
+				for (int j = 0; j < m->sec_hdr[i].sh_size / 8; j++) {
+					if (init_array[j] != 0) {
+						debugLog("%s: init_array on 0x%llx (%llx)\n", m->name.c_str(), (uintptr_t)init_array[j], (uintptr_t)init_array[j] - m->base);
+						so_run_fiber(so_dynarec, (uintptr_t)init_array[j]);
+					}
 				}
 			}
 		}
@@ -631,84 +1784,134 @@ void so_execute_init_array(void) {
 }
 
 uintptr_t so_find_addr(const char *symbol) {
-	for (int i = 0; i < num_syms; i++) {
-		char *name = dynstrtab + syms[i].st_name;
-		if (strcmp(name, symbol) == 0)
-			return (uintptr_t)text_base + syms[i].st_value;
-	}
+	Elf64_Sym *sym = so_lookup_sym(so_modules[0], symbol);
+	if (sym)
+		return so_modules[0]->base + sym->st_value;
 
 	debugLog("Error: could not find symbol:\n%s\n", symbol);
 	return 0;
 }
 
 uintptr_t so_find_rel_addr(const char *symbol) {
-	for (int i = 0; i < elf_hdr->e_shnum; i++) {
-		char *sh_name = shstrtab + sec_hdr[i].sh_name;
-		if (strcmp(sh_name, ".rela.dyn") == 0 || strcmp(sh_name, ".rela.plt") == 0) {
-			Elf64_Rela *rels = (Elf64_Rela *)((uintptr_t)text_base + sec_hdr[i].sh_addr);
-			for (int j = 0; j < sec_hdr[i].sh_size / sizeof(Elf64_Rela); j++) {
-				Elf64_Sym *sym = &syms[ELF64_R_SYM(rels[j].r_info)];
-
-				int type = ELF64_R_TYPE(rels[j].r_info);
-				if (type == R_AARCH64_GLOB_DAT || type == R_AARCH64_JUMP_SLOT) {
-					char *name = dynstrtab + sym->st_name;
-					if (strcmp(name, symbol) == 0)
-						return (uintptr_t)text_base + rels[j].r_offset;
-				}
-			}
-		}
-	}
+	auto it = so_modules[0]->got_by_name.find(symbol);
+	if (it != so_modules[0]->got_by_name.end())
+		return it->second;
 
 	debugLog("Error: could not find symbol:\n%s\n", symbol);
 	return 0;
 }
 
 const char *so_find_rela_name(uintptr_t rela_ptr) {
-	for (int i = 0; i < elf_hdr->e_shnum; i++) {
-		char *sh_name = shstrtab + sec_hdr[i].sh_name;
-		if (strcmp(sh_name, ".rela.dyn") == 0 || strcmp(sh_name, ".rela.plt") == 0) {
-			Elf64_Rela *rels = (Elf64_Rela *)((uintptr_t)text_base + sec_hdr[i].sh_addr);
-			for (int j = 0; j < sec_hdr[i].sh_size / sizeof(Elf64_Rela); j++) {
-				Elf64_Sym *sym = &syms[ELF64_R_SYM(rels[j].r_info)];
-				uintptr_t *ptr = (uintptr_t *)((uintptr_t)text_base + rels[j].r_offset);
-				int type = ELF64_R_TYPE(rels[j].r_info);
-				if (type == R_AARCH64_GLOB_DAT || type == R_AARCH64_JUMP_SLOT) {
-					char *name = dynstrtab + sym->st_name;
-					if ((uintptr_t)ptr == rela_ptr)
-						return name;
-				}
-			}
-		}
+	so_module *m = so_module_at(rela_ptr);
+	if (m) {
+		auto it = m->got_names.find(rela_ptr);
+		if (it != m->got_names.end())
+			return it->second;
 	}
 	return "Unknown symbol";
 }
 
 uintptr_t so_find_addr_rx(const char *symbol) {
-	for (int i = 0; i < num_syms; i++) {
-		char *name = dynstrtab + syms[i].st_name;
-		if (strcmp(name, symbol) == 0)
-			return (uintptr_t)syms[i].st_value;
-	}
+	Elf64_Sym *sym = so_lookup_sym(so_modules[0], symbol);
+	if (sym)
+		return (uintptr_t)sym->st_value;
 
 	debugLog("Error: could not find symbol:\n%s\n", symbol);
 	return 0;
 }
 
-dynarec_import *so_find_import(dynarec_import *funcs, int num_funcs, const char *name) {
-	for (int i = 0; i < num_funcs; ++i)
-		if (!strcmp(funcs[i].symbol, name))
-			return &funcs[i];
+// Returns the name of the symbol containing a given guest address, if any
+const char *so_find_symbol_name(uintptr_t addr, uintptr_t *offset) {
+	so_module *m = so_module_at(addr);
+	if (!m)
+		return NULL;
+	uintptr_t rx = addr - m->base;
+	auto it = std::upper_bound(m->sym_by_addr.begin(), m->sym_by_addr.end(), rx, [](uintptr_t v, Elf64_Sym *sym) {
+		return v < sym->st_value;
+	});
+	if (it == m->sym_by_addr.begin())
+		return NULL;
+	Elf64_Sym *sym = *(--it);
+	if (sym->st_size && rx >= sym->st_value + sym->st_size)
+		return NULL;
+	if (offset)
+		*offset = rx - sym->st_value;
+	return m->dynstrtab + sym->st_name;
+}
+
+const dynarec_thunk *so_find_import(const char *name) {
+	std::string_view key = name;
+	for (size_t slot = thunk_hash(key) & dynarec_imports_hash_mask; dynarec_imports_hash[slot]; slot = (slot + 1) & dynarec_imports_hash_mask) {
+		const dynarec_thunk *import = &dynarec_imports[dynarec_imports_hash[slot] - 1];
+		if (import->symbol == key)
+			return import;
+	}
 	return NULL;
 }
 
+// Room below TPIDR_EL0 for the negative slots, keeps TPIDR_EL0 aligned for every TLS segment
+static size_t so_tls_prefix(void) {
+	return ALIGN_MEM(std::max<size_t>((DYNAREC_TLS_KEYS - DYNAREC_TLS_SLOT_MIN) * 8, so_tls_align), so_tls_align);
+}
+
+static size_t so_tls_block_size(void) {
+	return std::max<size_t>(so_tls_prefix() + so_tls_size, DYNAREC_TPIDR_SIZE);
+}
+
+// Allocates the TLS block of a guest thread, filled from the module templates, and returns
+// the value its TPIDR_EL0 has to hold. Modules have to be relocated already.
+uintptr_t so_tls_alloc(void) {
+	size_t size = so_tls_block_size();
+	uint8_t *block = (uint8_t *)guest_mem_alloc(size);
+	if (!block)
+		return 0;
+#ifdef USE_INTERPRETER
+	if (!so_uc_map((uintptr_t)block, size)) {
+		debugLog("Failed to map TLS block\n");
+		guest_mem_free(block, size);
+		return 0;
+	}
+#endif
+
+	uintptr_t tp = (uintptr_t)block + so_tls_prefix();
+	so_tls_reset(tp);
+	return tp;
+}
+
+// Brings a TLS block back to its initial state, so that it can be handed to a new guest thread
+void so_tls_reset(uintptr_t tp) {
+	memset((void *)(tp - so_tls_prefix()), 0, so_tls_block_size());
+	for (so_module *m : so_modules) {
+		if (m->tls_filesz)
+			memcpy((void *)(tp + m->tls_offset), (void *)m->tls_image, m->tls_filesz);
+	}
+	((uint64_t *)tp)[DYNAREC_TLS_SLOT_STACK_GUARD] = __stack_chk_guard_fake;
+}
+
+// pthread key values of the thread owning the block, indexed by key
+uintptr_t *so_tls_keys(uintptr_t tp) {
+	return (uintptr_t *)tp + DYNAREC_TLS_SLOT_MIN - DYNAREC_TLS_KEYS;
+}
+
+void so_tls_free(uintptr_t tp) {
+	void *block = (void *)(tp - so_tls_prefix());
+#ifdef USE_INTERPRETER
+	so_uc_unmap((uintptr_t)block, so_tls_block_size());
+#endif
+	guest_mem_free(block, so_tls_block_size());
+}
+
 int so_unload(void) {
-	if (load_base == NULL)
+	if (so_modules.empty())
 		return -1;
 
-	if (so_base) {
-		// someone forgot to free the temp data
-		so_free_temp();
+	// someone may have forgotten to free the temp data
+	so_free_temp();
+	for (so_module *m : so_modules) {
+		guest_mem_free(m->load_base, m->load_size);
+		delete m;
 	}
+	so_modules.clear();
 
 	return 0;
 }
@@ -721,34 +1924,39 @@ std::optional<std::uint32_t> so_env::MemoryReadCode(std::uint64_t vaddr)
 	if (vaddr == (uintptr_t)unresolved_stub_token) {
 		uintptr_t f1 = so_dynarec->GetRegister(16);
 		uintptr_t f2 = so_dynarec->GetRegister(17);
-		return 0xD4000001 | (2 << 5);
+		return DYNAREC_SVC(DYNAREC_SVC_UNRESOLVED);
+	// found the canary token for not yet bound PLT slots
+	} else if (vaddr == (uintptr_t)lazy_bind_token) {
+		return DYNAREC_SVC(DYNAREC_SVC_LAZY_BIND);
 	// found the canary token for returning from top-level function
 	} else if (vaddr == (uintptr_t)end_program_token) {
 		debugLog("vaddr %p: emitting end_program_token\n", vaddr);
-		return 0xD4000001 | (0 << 5);
+		return DYNAREC_SVC(DYNAREC_SVC_EXIT);
 	}
-	
-#ifdef TPIDR_EL0_HACK
-		if ((uintptr_t)vaddr < 0x1000)
-			vaddr += (uintptr_t)tpidr_el0;
-#endif
-		return *(std::uint32_t *)(vaddr);
+
+	return *(std::uint32_t *)(vaddr);
 }
 void so_env::CallSVC(std::uint32_t swi)
 {
-	uintptr_t pc = so_dynarec->GetPC() - 0x4;
+	// Host thunks run straight from here so the guest never leaves the dispatcher, PC
+	// already points to the RET that follows the SVC in the trampoline. Thunks that need
+	// to execute guest code on their own can't re-enter Run, so those halt instead.
+	if (swi & DYNAREC_SVC_THUNK) {
+		if (swi & DYNAREC_SVC_THUNK_NESTED) {
+			so_pending_thunk = swi & DYNAREC_SVC_THUNK_MASK;
+			so_dynarec->HaltExecution(Dynarmic::HaltReason::UserDefined2);
+		} else {
+			so_find_thunk(swi & DYNAREC_SVC_THUNK_MASK)->bridge(so_dynarec);
+		}
+		return;
+	}
+
 	switch (swi) {
-	case 0:
+	case DYNAREC_SVC_EXIT:
 		// Execution done
 		so_dynarec->HaltExecution();
 		break;
-	case 1:
-		// Yield from guest for a moment to handle host code requested,
-		// leaving this instance available for nested callbacks and whatnot
-		//debugLog("Halting for host function execution: %p\n", so_dynarec->GetPC());
-		so_dynarec->HaltExecution(Dynarmic::HaltReason::UserDefined2);
-		break;
-	case 2:
+	case DYNAREC_SVC_UNRESOLVED:
 		{
 			// Let's find the .got entry for this function, so we can display an error
 			// message.
@@ -757,6 +1965,9 @@ void so_env::CallSVC(std::uint32_t swi)
 			so_dynarec->HaltExecution(Dynarmic::HaltReason::MemoryAbort);
 		}
 		break;
+	case DYNAREC_SVC_LAZY_BIND:
+		so_lazy_bind(so_dynarec);
+		break;
 	default:
 		printf("Unknown SVC %d\n", swi);
 		break;
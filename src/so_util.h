@@ -19,58 +19,67 @@
 #endif
 
 #include <stdint.h>
+#include <array>
+#include <atomic>
+#include <string_view>
 
 #define ALIGN_MEM(x, align) (((x) + ((align) - 1)) & ~((align) - 1))
 
 typedef struct {
-#ifdef USE_INTERPRETER
-	bool mapped;
-#endif
-	char *symbol;
-	uintptr_t ptr; /* NULL means using the trampoline instead. */
-#ifdef USE_INTERPRETER
-	uint32_t trampoline;
-#else
-	uint32_t trampoline[2];
-#endif
-} dynarec_import;
-
-typedef struct {
-#ifdef USE_INTERPRETER
-	bool mapped;
-	uint32_t trampoline;
-#else
-	uint32_t trampoline[2];
-#endif
-} dynarec_hook;
+	std::string_view symbol;
+	void (*bridge)(Dynarmic::A64::Jit *jit);
+	bool nested; // Runs guest code on its own, see so_env::CallSVC
+} dynarec_thunk;
 
-extern dynarec_import dynarec_imports[];
-extern size_t dynarec_imports_num;
+extern const dynarec_thunk dynarec_imports[];
+extern const size_t dynarec_imports_num;
+extern const std::array<uint32_t, 2> *dynarec_imports_trampolines;
+extern const uint16_t *dynarec_imports_hash;
+extern const size_t dynarec_imports_hash_mask;
+extern const uint32_t dynarec_imports_signature;
+extern const dynarec_thunk dynarec_hooks[];
+extern const size_t dynarec_hooks_num;
 
 extern void *text_base, *data_base;
 extern size_t text_size, data_size;
 
-void hook_arm64(uintptr_t addr, dynarec_hook *dst);
+// Lazy PLT binding (Dynarmic only), JUMP_SLOT relocations get bound on first call
+extern bool so_lazy_binding;
+extern std::atomic<int> so_lazy_slots;
+extern std::atomic<int> so_lazy_bound;
+
+extern std::atomic<uint64_t> so_text_invalidations; // Text pages invalidated after trapped writes, see so_protect_text
 
+const dynarec_thunk *so_find_thunk(uint32_t id);
+void hook_arm64(uintptr_t addr, uint32_t id);
+
+void so_jit_register(Dynarmic::A64::Jit *jit, int processor_id);
+void so_jit_unregister(int processor_id);
 void so_flush_caches(void);
+void so_install_fault_handler(void);
+void so_protect_text(void);
+bool so_protect_text_range(uintptr_t addr, size_t size);
+void so_patch_text(uintptr_t addr, const void *data, size_t size);
 void so_free_temp(void);
 int so_load(const char *filename, void **base_addr);
 int so_relocate();
-int so_resolve(dynarec_import *funcs, int num_funcs);
+int so_resolve(void);
+int so_cache_load(void);
+int so_cache_save(void);
 void so_execute_init_array(void);
+uintptr_t so_tls_alloc(void);
+void so_tls_reset(uintptr_t tp);
+uintptr_t *so_tls_keys(uintptr_t tp);
+void so_tls_free(uintptr_t tp);
 uintptr_t so_find_addr(const char *symbol);
 uintptr_t so_find_addr_rx(const char *symbol);
 uintptr_t so_find_rel_addr(const char *symbol);
-dynarec_import *so_find_import(dynarec_import *funcs, int num_funcs, const char *name);
+const char *so_find_rela_name(uintptr_t rela_ptr);
+const char *so_find_symbol_name(uintptr_t addr, uintptr_t *offset);
+const dynarec_thunk *so_find_import(const char *name);
 int so_unload(void);
 void so_run_fiber(Dynarmic::A64::Jit *jit, uintptr_t entry);
 
-#define HOOK_FUNC(symname, func) \
-	{ \
-		dynarec_hook hook = gen_trampoline<&func>(symname); \
-		hook_arm64((uintptr_t)dynarec_base_addr + so_find_addr_rx(symname), &hook); \
-	}
-
 #ifdef NDEBUG
 #define debugLog
 #else
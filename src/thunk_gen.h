@@ -1,16 +1,16 @@
 #pragma once
+#include <array>
 #include <cstdint>
 #include <type_traits>
 #include <typeinfo>
 #include <functional>
 #include <tuple>
+#include <utility>
 #include <iostream>
+#include <string_view>
 
 extern void *dynarec_base_addr;
-extern std::vector<uintptr_t> native_funcs;
-extern std::vector<std::string> native_funcs_names;
 #ifdef USE_INTERPRETER
-extern std::vector<uc_hook> hooks;
 extern uintptr_t next_pc;
 #endif
 
@@ -23,116 +23,113 @@ struct ThunkImpl {
 	using Tuple = std::tuple<Args...>;
 	static constexpr auto size = sizeof...(Args);
 	
-	// Gather a single argument from the guest environment. If the first argument is a
-	// jit instance pointer, then we'll inject it from the current env instead of the
-	// argument pack provided by the guest.
-	template <typename T> static T get(int &i, int &r, int &f, uintptr_t &sp, Dynarmic::A64::Jit *jit) {
-		// Do we inject a jit instance into this index of the argument list?
-		int idx = i++;
-		if (idx == 0) {
-			if constexpr (std::is_same_v<T, Dynarmic::A64::Jit *>)
-				return jit;
-		}
+	// Location of an argument in the guest environment as per AAPCS64
+	enum ArgLoc { ARG_JIT, ARG_INT, ARG_FLOAT, ARG_STACK };
+	struct ArgSlot {
+		ArgLoc loc;
+		int idx; // Register number or byte offset from SP
+	};
 
-		// Get the index of the register per-type
-		int idx_reg = [&](){
-			if constexpr (std::is_floating_point_v<T>) {
-				return f++;
-			} else {
-				return r++;
+	// Argument count and types are known at compile time, so are their locations. If the
+	// first argument is a jit instance pointer, then we'll inject it from the current env
+	// instead of the argument pack provided by the guest.
+	static constexpr std::array<ArgSlot, size> slots = []() {
+		std::array<ArgSlot, size> res = {};
+		constexpr bool is_float[] = { std::is_floating_point_v<Args>..., false };
+		constexpr bool is_jit[] = { std::is_same_v<Args, Dynarmic::A64::Jit *>..., false };
+		int r = 0, f = 0, stack = 0;
+		for (size_t i = 0; i < size; i++) {
+			int &reg = is_float[i] ? f : r;
+			if (i == 0 && is_jit[i])
+				res[i] = { ARG_JIT, 0 };
+			else if (reg < 8)
+				res[i] = { is_float[i] ? ARG_FLOAT : ARG_INT, reg++ };
+			else {
+				res[i] = { ARG_STACK, stack };
+				stack += 8;
 			}
-		}();
+		}
+		return res;
+	}();
+	static constexpr bool uses_vectors = (std::is_floating_point_v<Args> || ...);
 
-		// If we exausted the available registers, then we have to
-		// fetch the instruction from the stack.
-		if (idx_reg > 7) {
-			uintptr_t pre_decrement_sp = sp;
-			sp -= 8;
-			return *(T*)pre_decrement_sp;
-		} else {
-			if constexpr (std::is_floating_point_v<T>) {
+	// Snapshot of the argument registers. Dynarmic hands out the whole register file in a
+	// single call, vectors are 128 bit wide there so the lower half of Vn is at d[n * 2].
+	struct Regs {
 #ifdef USE_INTERPRETER
-				if constexpr (sizeof(T) == 8) {
-					double reg_val;
-					uc_reg_read(uc, UC_ARM64_REG_D0 + idx_reg, (void*)&reg_val);
-					return (T)reg_val;
-				} else {
-					float reg_val;
-					uc_reg_read(uc, UC_ARM64_REG_S0 + idx_reg, (void*)&reg_val);
-					return (T)reg_val;
-				}
+		uint64_t x[8];
+		uint64_t d[8];
+		static constexpr int d_stride = 1;
 #else
-				Dynarmic::A64::Vector reg_val = jit->GetVector(idx_reg);
-				return *(T*)&reg_val[0];
+		std::array<std::uint64_t, 31> x;
+		std::array<Dynarmic::A64::Vector, 32> v;
+		const uint64_t *d;
+		static constexpr int d_stride = 2;
 #endif
-			} else if constexpr (std::is_pointer_v<T> || std::is_integral_v<T> || std::is_enum_v<T>) {
-#ifdef USE_INTERPRETER
-				uint64_t reg_val;
-				uc_reg_read(uc, UC_ARM64_REG_X0 + idx_reg, &reg_val);
-				return (T)reg_val;
-#else
-				return (T)(jit->GetRegister(idx_reg));
-#endif
-			} else if constexpr (sizeof(T) <= 16) {
-#ifdef USE_INTERPRETER
-				uint64_t reg_val;
-				uc_reg_read(uc, UC_ARM64_REG_X0 + idx_reg, &reg_val);
-				return (T)reg_val;
-#else
-				return (T)(jit->GetRegister(idx_reg));
-#endif
-			} else {
-#ifdef USE_INTERPRETER
-				uint64_t reg_val;
-				uc_reg_read(uc, UC_ARM64_REG_X0 + idx_reg, &reg_val);
-				return *(T*)reg_val;
-#else
-				return *(T*)jit->GetRegister(idx_reg);
-#endif
-			}
+	};
+
+	// Unpack a single argument from the snapshot
+	template <typename T, size_t I> static T get(const Regs &regs, uintptr_t sp, Dynarmic::A64::Jit *jit) {
+		constexpr ArgSlot slot = slots[I];
+		if constexpr (slot.loc == ARG_JIT) {
+			return (T)jit;
+		} else if constexpr (slot.loc == ARG_STACK) {
+			// Composites bigger than 16 bytes are passed by reference
+			if constexpr (std::is_floating_point_v<T> || std::is_pointer_v<T> || std::is_integral_v<T> || std::is_enum_v<T> || sizeof(T) <= 16)
+				return *(T *)(sp + slot.idx);
+			else
+				return **(T **)(sp + slot.idx);
+		} else if constexpr (slot.loc == ARG_FLOAT) {
+			return *(T *)&regs.d[slot.idx * Regs::d_stride];
+		} else if constexpr (std::is_pointer_v<T> || std::is_integral_v<T> || std::is_enum_v<T> || sizeof(T) <= 16) {
+			return (T)regs.x[slot.idx];
+		} else {
+			return *(T *)regs.x[slot.idx];
 		}
 	}
 
-	struct BraceCall
-	{
-		R ret;
-		inline BraceCall(Args... args) : ret( D::template bridge_impl<Args...>(args...) ) { };
-	};
-
-	struct BraceCallVoid
-	{
-		inline BraceCallVoid(Args... args) { D::template bridge_impl<Args...>(args...); };
-	};
+	template <size_t... I> static auto call(const Regs &regs, uintptr_t sp, Dynarmic::A64::Jit *jit, std::index_sequence<I...>) {
+		return D::template bridge_impl<Args...>(get<Args, I>(regs, sp, jit)...);
+	}
 
 	__attribute__((noinline)) static void bridge(Dynarmic::A64::Jit *jit)
 	{
-		// Store the return address of the function
+		// Take a snapshot of the guest environment
+		Regs regs;
 #ifdef USE_INTERPRETER
-		uintptr_t addr_next;
+		static int reg_ids[16] = {
+			UC_ARM64_REG_X0, UC_ARM64_REG_X0 + 1, UC_ARM64_REG_X0 + 2, UC_ARM64_REG_X0 + 3,
+			UC_ARM64_REG_X0 + 4, UC_ARM64_REG_X0 + 5, UC_ARM64_REG_X0 + 6, UC_ARM64_REG_X0 + 7,
+			UC_ARM64_REG_D0, UC_ARM64_REG_D0 + 1, UC_ARM64_REG_D0 + 2, UC_ARM64_REG_D0 + 3,
+			UC_ARM64_REG_D0 + 4, UC_ARM64_REG_D0 + 5, UC_ARM64_REG_D0 + 6, UC_ARM64_REG_D0 + 7,
+		};
+		void *reg_vals[16] = {
+			&regs.x[0], &regs.x[1], &regs.x[2], &regs.x[3], &regs.x[4], &regs.x[5], &regs.x[6], &regs.x[7],
+			&regs.d[0], &regs.d[1], &regs.d[2], &regs.d[3], &regs.d[4], &regs.d[5], &regs.d[6], &regs.d[7],
+		};
+		uc_reg_read_batch(uc, reg_ids, reg_vals, uses_vectors ? 16 : 8);
+		uintptr_t sp, addr_next;
+		uc_reg_read(uc, UC_ARM64_REG_SP, &sp);
 		uc_reg_read(uc, REG_FP, &addr_next);
 #else
-		uintptr_t addr_next = jit->GetRegister(REG_FP);
+		regs.x = jit->GetRegisters();
+		if constexpr (uses_vectors) {
+			regs.v = jit->GetVectors();
+			regs.d = &regs.v[0][0];
+		}
+		uintptr_t sp = jit->GetSP();
+		uintptr_t addr_next = regs.x[REG_FP];
 #endif
 #ifdef GDB_ENABLED
 		gdb_thunk_fp = addr_next;
 #endif
 		//debugLog("RA is %llx\n", (uintptr_t)addr_next - (uintptr_t)dynarec_base_addr);
-		
-		// Gather arguments from the guest environment and pass them to the wrapped
-		// function.
-#ifdef USE_INTERPRETER
-		uintptr_t sp;
-		uc_reg_read(uc, UC_ARM64_REG_SP, &sp);
-#else
-		uintptr_t sp = jit->GetSP();
-#endif
-		int float_reg_cnt = 0;
-		int int_reg_cnt = 0;
-		int reg_cnt = 0;
+
+		// Pass the arguments to the wrapped function
 		if constexpr (std::is_void_v<R>) {
-			BraceCallVoid { get<Args>(reg_cnt, int_reg_cnt, float_reg_cnt, sp, jit)... };
+			call(regs, sp, jit, std::index_sequence_for<Args...>{});
 		} else {
-			R ret = BraceCall { get<Args>(reg_cnt, int_reg_cnt, float_reg_cnt, sp, jit)... }.ret;
+			R ret = call(regs, sp, jit, std::index_sequence_for<Args...>{});
 			if constexpr (std::is_floating_point_v<R>) {
 				uint64_t ret_cast;
 				if constexpr (sizeof(R) == 8)
@@ -158,9 +155,9 @@ struct ThunkImpl {
 #ifdef USE_INTERPRETER
 		uc_reg_write(uc, UC_ARM64_REG_PC, &addr_next);
 		//debugLog("jump back to %llx (%llx)\n", addr_next, addr_next - (uintptr_t)dynarec_base_addr);
-#else
-		jit->SetPC(addr_next);
 #endif
+		// On Dynarmic, PC is left on the RET following the SVC so that the guest returns
+		// by itself and keeps its return stack prediction intact.
 	}
 };
 
@@ -176,8 +173,7 @@ template<auto Def, typename PFN>
 struct Thunk : ThunkImpl<Thunk<Def, PFN>, PFN>
 {
 public:
-	static inline PFN func;
-	static inline const char* symname = NULL;
+	static constexpr PFN func = Def;
 	using ReturnType = typename decltype(std::function{func})::result_type;
 
 	// Convert any pointer type to a generic void* type
@@ -203,58 +199,82 @@ public:
 	}
 };
 
+// Set nested for thunks that execute guest code (eg. through so_run_fiber), these can't
+// run from inside the SVC handler and are dispatched after halting the Jit instead.
 template <auto F, class T = Thunk<F, decltype(F)>>
-dynarec_import gen_wrapper(const char *symname)
+constexpr dynarec_thunk gen_wrapper(std::string_view symname, bool nested = false)
 {
-	// Setup the static fields
-	T::func = F;
-	T::symname = symname;
-	uintptr_t f = (uintptr_t)T::bridge;
-	native_funcs.push_back(f);
-	native_funcs_names.push_back(symname);
+	return (dynarec_thunk) {
+		.symbol = symname,
+		.bridge = &T::bridge,
+		.nested = nested,
+	};
+}
 
-	// Setup the trampoline
-	return (dynarec_import) {
-#ifdef USE_INTERPRETER
-		.mapped = false,
-#endif
-		.symbol = (char *)symname,
-		.ptr = 0,
-		// The trampoline works by calling an SVC Handler where we then
-		// grab the function index from PC
-#ifdef USE_INTERPRETER
-		.trampoline = (uint32_t)((native_funcs.size() - 1) * 4)
-#else
-		.trampoline = {
-			0xD4000021,	// SVC 0x1
-			(uint32_t)(native_funcs.size() - 1),
-		}
-#endif
+// The trampoline works by calling an SVC Handler which gets the thunk id from the
+// SVC immediate, then returns to the caller
+constexpr std::array<uint32_t, 2> gen_trampoline(uint32_t id, bool nested)
+{
+	return {
+		DYNAREC_SVC(DYNAREC_SVC_THUNK | (nested ? DYNAREC_SVC_THUNK_NESTED : 0) | id),
+		DYNAREC_RET,
 	};
 }
 
-template <auto F, class T = Thunk<F, decltype(F)>>
-dynarec_hook gen_trampoline(const char *symname)
+template <size_t N>
+constexpr std::array<std::array<uint32_t, 2>, N> gen_trampolines(const dynarec_thunk (&thunks)[N], uint32_t id_base)
 {
-	// Setup the static fields
-	T::func = F;
-	T::symname = symname;
-	uintptr_t f = (uintptr_t)T::bridge;
-	native_funcs.push_back(f);
-	native_funcs_names.push_back(symname);
+	static_assert(N <= DYNAREC_THUNK_INDEX_MASK + 1, "Too many thunks in a single table");
+	std::array<std::array<uint32_t, 2>, N> res = {};
+	for (size_t i = 0; i < N; i++)
+		res[i] = gen_trampoline(id_base | i, thunks[i].nested);
+	return res;
+}
 
-	// Setup the trampoline
-	return (dynarec_hook) {
-#ifdef USE_INTERPRETER
-		.mapped = true,
-		.trampoline = (uint32_t)((native_funcs.size() - 1) * 4)
-#else
-		// The trampoline works by calling an SVC Handler where we then
-		// grab the function index from PC
-		.trampoline = {
-			0xD4000021,	// SVC 0x1
-			(uint32_t)(native_funcs.size() - 1),
-		}
-#endif
-	};
-}
\ No newline at end of file
+// FNV-1a, used to look imports up by name
+constexpr uint32_t thunk_hash(std::string_view name)
+{
+	uint32_t h = 2166136261u;
+	for (char c : name) {
+		h ^= (uint8_t)c;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+constexpr size_t thunk_hash_size(size_t num)
+{
+	size_t size = 1;
+	while (size < num * 2)
+		size <<= 1;
+	return size;
+}
+
+// Open addressing table with linear probing, slots hold the thunk index + 1 (0 means empty).
+// Being built at compile time, lookups never pay for its construction.
+template <size_t N>
+constexpr std::array<uint16_t, thunk_hash_size(N)> gen_thunk_hash(const dynarec_thunk (&thunks)[N])
+{
+	constexpr size_t mask = thunk_hash_size(N) - 1;
+	std::array<uint16_t, thunk_hash_size(N)> res = {};
+	for (size_t i = 0; i < N; i++) {
+		size_t slot = thunk_hash(thunks[i].symbol) & mask;
+		while (res[slot] && thunks[res[slot] - 1].symbol != thunks[i].symbol)
+			slot = (slot + 1) & mask;
+		if (!res[slot])
+			res[slot] = i + 1;
+	}
+	return res;
+}
+
+// Identifies the content of a thunk table, changes whenever an entry is added, removed or moved
+template <size_t N>
+constexpr uint32_t gen_thunk_table_hash(const dynarec_thunk (&thunks)[N])
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < N; i++) {
+		h = (h ^ thunk_hash(thunks[i].symbol)) * 16777619u;
+		h = (h ^ thunks[i].nested) * 16777619u;
+	}
+	return h;
+}